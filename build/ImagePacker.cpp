@@ -4,6 +4,14 @@
 #include "stdafx.h"
 #include "picosha2.h"
 #include "ThreadPool.h"
+#include "packer.h"
+#include "packcache.h"
+#include "pixelkernels.h"
+#include "pngencoder.h"
+#include "texencoder.h"
+#include "atlasindexwriter.h"
+#include "tiledict.h"
+#include "profiler.h"
 #include <atomic>
 #ifdef _WIN32
 #include <fcntl.h>
@@ -22,7 +30,7 @@ int lastPOT(double x)
 
 void print_usage(const wchar_t *exe)
 {
-	wcout << exe << " -o filename [-d Directory=./] [-sz width=256] [--includesubdir] [--disablerot] [--disablebound] [--enablesplit] [-format format=bke] [-ol listfilename] [-maxwidth width=2048]" << endl
+	wcout << exe << " -o filename [-d Directory=./] [-sz width=256] [--includesubdir] [--disablerot] [--disablebound] [--enablesplit] [-format format=bke] [-ol listfilename] [-maxwidth width=2048] [--nocache] [-membudget size] [-pnglevel level=6] [-pngfilter filter=adaptive] [-j threads] [-tile size] [-texformat format=png] [--premultiply] [-extrude pixels] [--alphableed] [--profile]" << endl
 		<< "For example:" << endl
 		<< exe << "-o output -sz 512 --enablesplit -format bagel -maxwidth 4096" << endl << endl
 		<< "\t-o means output file (image file and data file), without extension" << endl
@@ -31,9 +39,21 @@ void print_usage(const wchar_t *exe)
 		<< "\t--disablerot means don't rotate picture 90 degree when generate packer image" << endl
 		<< "\t--disablebound means don't scissor alpha area when packing images" << endl
 		<< "\t--enablesplit means we may split the picture into small parts during packing, usually used in long slice image" << endl
-		<< "\t-format means the format of output data, now only can be bke" << endl
+		<< "\t-format means the format of output data, can be bke, json, or bin(filename.atlasidx, an index to be mapped by runtime, see atlasindex.h)" << endl
 		<< "\t-ol means the filename of the output list file, tell you which files are packed" << endl
 		<< "\t-maxwidth means the maximum width and height of the merge image, default is 2048, will cut to power of two(i.e, 2000 is same as 1024)" << endl
+		<< "\t\timages which can't be put in one image go to more pages, named filename_1, filename_2 ..." << endl
+		<< "\t--nocache means don't read or write the cache file(filename.pcache), which keeps trimmed images of last run" << endl
+		<< "\t-membudget means the memory for pixels is about this size(e.g. 512M, 2G), trimmed images are kept in the cache file instead of memory, and batch images are written by strips" << endl
+		<< "\t-pnglevel means the zlib compression level(0-9) of batch images, 0 is fastest and 9 is smallest" << endl
+		<< "\t-pngfilter means the png filter of batch images, can be none, sub, up, avg, paeth or adaptive(choose for each line)" << endl
+		<< "\t-texformat means the format of batch images, can be png, bc1(dds), bc3(dds), etc2(ktx) or rgba4444(ktx), images start at 4*4 blocks for bc1, bc3 and etc2" << endl
+		<< "\t--premultiply means multiply colors of batch images by alpha" << endl
+		<< "\t-extrude means repeat edge pixels of every rect this many times around it, to avoid seams when the texture is filtered" << endl
+		<< "\t--alphableed means fill colors of transparent pixels with colors of the nearest visible ones" << endl
+		<< "\t-tile means cut trimmed images into tiles of this size, identical tiles are stored only once, and images are output as lists of rects" << endl
+		<< "\t-j means the number of threads for loading, packing and encoding, default is the count of cores" << endl
+		<< "\t--profile means save time of every phase, counters and peak memory to filename.profile.json" << endl
 		;
 }
 
@@ -52,10 +72,26 @@ struct
 	{
 		FMT_BKE,
 		FMT_JSON,
-		FMT_PLIST
+		FMT_PLIST,
+		FMT_BIN
 	}format;
 	bool compact;
 	int maxwidth;
+	bool cache;
+	//0 for no limit
+	int64_t membudget;
+	int pnglevel;
+	int pngfilter;
+	//0 for the count of cores
+	int threads;
+	//size of tiles for dedup, 0 or less to disable
+	int tile;
+	//TextureFormat of batch images
+	int texformat;
+	bool premultiply;
+	int extrude;
+	bool alphableed;
+	bool profile;
 }options;
 
 void initOption()
@@ -69,6 +105,40 @@ void initOption()
 	options.format = options.FMT_BKE;
 	options.compact = false;
 	options.maxwidth = 2048;
+	options.cache = true;
+	options.membudget = 0;
+	options.pnglevel = 6;
+	options.pngfilter = PNGEncoder::FILTER_ADAPTIVE;
+	options.threads = 0;
+	options.tile = 0;
+	options.texformat = TEXTURE_PNG;
+	options.premultiply = false;
+	options.extrude = 0;
+	options.alphableed = false;
+	options.profile = false;
+}
+
+//size with unit K, M or G
+int64_t parseSize(const wchar_t *str)
+{
+	wchar_t *end;
+	int64_t res = wcstoll(str, &end, 10);
+	switch (*end)
+	{
+	case 'k':
+	case 'K':
+		res <<= 10;
+		break;
+	case 'm':
+	case 'M':
+		res <<= 20;
+		break;
+	case 'g':
+	case 'G':
+		res <<= 30;
+		break;
+	}
+	return max(res, (int64_t)0);
 }
 
 //if file is a relative path, set it to be full path by see it as a file under dir
@@ -154,6 +224,10 @@ void readOption(int argc, wchar_t ** argv)
 				{
 					options.format = options.FMT_PLIST;
 				}
+				else if (!wcscmp(L"bin", *argv))
+				{
+					options.format = options.FMT_BIN;
+				}
 				else
 				{
 					wcout << "invalid format:" << *argv << endl;
@@ -164,6 +238,88 @@ void readOption(int argc, wchar_t ** argv)
 		{
 			options.compact = true;
 		}
+		else if (!wcscmp(L"--profile", *argv))
+		{
+			options.profile = true;
+		}
+		else if (!wcscmp(L"--nocache", *argv))
+		{
+			options.cache = false;
+		}
+		else if (!wcscmp(L"-membudget", *argv))
+		{
+			++argv;
+			if (argv)
+				options.membudget = parseSize(*argv);
+		}
+		else if (!wcscmp(L"-pnglevel", *argv))
+		{
+			++argv;
+			if (argv)
+			{
+				int level = wcstol(*argv, nullptr, 10);
+				if (level >= 0 && level <= 9)
+					options.pnglevel = level;
+				else
+					wcout << "invalid png level:" << *argv << endl;
+			}
+		}
+		else if (!wcscmp(L"-pngfilter", *argv))
+		{
+			++argv;
+			if (argv)
+			{
+				int filter = PNGEncoder::parseFilter(*argv);
+				if (filter >= 0)
+					options.pngfilter = filter;
+				else
+					wcout << "invalid png filter:" << *argv << endl;
+			}
+		}
+		else if (!wcscmp(L"-texformat", *argv))
+		{
+			++argv;
+			if (argv)
+			{
+				int format = parseTextureFormat(*argv);
+				if (format >= 0)
+					options.texformat = format;
+				else
+					wcout << "invalid texture format:" << *argv << endl;
+			}
+		}
+		else if (!wcscmp(L"--premultiply", *argv))
+		{
+			options.premultiply = true;
+		}
+		else if (!wcscmp(L"-extrude", *argv))
+		{
+			++argv;
+			if (argv)
+			{
+				int extrude = wcstol(*argv, nullptr, 10);
+				if (extrude >= 0)
+					options.extrude = extrude;
+				else
+					wcout << "invalid extrude:" << *argv << endl;
+			}
+		}
+		else if (!wcscmp(L"--alphableed", *argv))
+		{
+			options.alphableed = true;
+		}
+		else if (!wcscmp(L"-tile", *argv))
+		{
+			++argv;
+			if (argv)
+				options.tile = wcstol(*argv, nullptr, 10);
+		}
+		else if (!wcscmp(L"-j", *argv))
+		{
+			++argv;
+			if (argv)
+				options.threads = wcstol(*argv, nullptr, 10);
+		}
 		else if (!wcscmp(L"-maxwidth", *argv))
 		{
 			++argv;
@@ -262,15 +418,6 @@ void getFiles(const wstring &parentDir)
 #endif
 
 typedef Image Img;
-typedef struct  
-{
-	int x, y;
-} Point;
-typedef struct  
-{
-	int x, y;
-	int w, h;
-} Rect;
 
 struct ImageInfo
 {
@@ -283,6 +430,10 @@ struct ImageInfo
 
 	bool rot90;
 	vector<Rect> dstRect;
+	//which page the image is packed in
+	int page;
+	//for -tile, index in tiledict of each rect in split
+	vector<int> tiles;
 };
 
 struct
@@ -292,6 +443,14 @@ struct
 	int totalArea;
 }stat_info;
 
+struct PageInfo
+{
+	int w, h;
+};
+vector<PageInfo> pages;
+
+TileDict tiledict;
+
 struct array32_hash
 {
 	size_t operator()(const array<unsigned char, 32> &arr) const
@@ -331,8 +490,71 @@ std::mutex infomapmutex;
 unordered_map<Img*, ImageInfo> infomap;
 unordered_map<array<unsigned char, 32>, Img *, array32_hash, array32_equal> hashedinfomap; // Map with hash to Img
 
+PackCache packcache;
+//trimmed pixels are written to it while loading
+PackCacheWriter cachewriter;
+//cache entries of all loaded files in this run
+unordered_map<wstring, PackCache::Entry> cacheentries;
+//pixels of images are dropped after loading, and read from the cache file when blitting
+bool outofcore = false;
+
+uint32_t getCacheFlags()
+{
+	return (options.bound ? PackCache::FLAG_BOUND : 0) | (options.rot90 ? PackCache::FLAG_ROT90 : 0);
+}
+
+wstring cacheFileName()
+{
+	return options.output + L".pcache";
+}
+
+//the new cache file, or a spill file for -membudget with --nocache
+wstring cacheWriterFileName()
+{
+	if (options.cache)
+		return cacheFileName() + L".tmp";
+	return options.output + L".spill";
+}
+
+void removeFile(const wstring &file)
+{
+#ifdef _WIN32
+	_wremove(file.c_str());
+#else
+	remove(UniToUTF8(file).c_str());
+#endif
+}
+
+bool renameFile(const wstring &from, const wstring &to)
+{
+	removeFile(to);
+#ifdef _WIN32
+	return _wrename(from.c_str(), to.c_str()) == 0;
+#else
+	return rename(UniToUTF8(from).c_str(), UniToUTF8(to).c_str()) == 0;
+#endif
+}
+
+bool writeFile(const wstring &file, const string &data)
+{
+#ifdef _WIN32
+	FILE *f = _wfopen(file.c_str(), L"wb");
+#else
+	FILE *f = fopen(UniToUTF8(file).c_str(), "wb");
+#endif
+	if (!f)
+		return false;
+	bool ok = data.empty() || fwrite(data.data(), data.size(), 1, f) == 1;
+	if (fclose(f))
+		ok = false;
+	return ok;
+}
+
+wstring pageImageFileName(int page);
+
 void findBounding(Img *img, ImageInfo& info)
 {
+	ProfileScope scope(Profiler::PHASE_BOUNDING);
 	//ABGR8888
 	//memory layout:R->G->B->A
 	info.bounding = { 0,0,info.rawwidth, info.rawheight };
@@ -340,61 +562,25 @@ void findBounding(Img *img, ImageInfo& info)
 	{
 		return;
 	}
-	auto data = (unsigned char*)img->pixels;
-	int width = img->w;
-	int height = img->h;
-	//x axis
-	auto scanx = [&](int x1, int x2, int y)
+	//scan rows in memory order, left and right come from the union of every row's range
+	int top = info.rawheight, bottom = -1;
+	int left = info.rawwidth, right = -1;
+	for (int y = 0; y < info.rawheight; y++)
 	{
-		auto start = &data[y * img->pitch + x1] + 3;
-		for (int x = x1; x < x2; x++)
-		{
-			if (*start > 0)
-				return false;
-			start += 4;
-		}
-		return true;
-	};
-	while (info.bounding.y < info.rawheight)
-	{
-		if (!scanx(info.bounding.x, info.bounding.x + info.bounding.w, info.bounding.y))
-			break;
-		++info.bounding.y;
-		--info.bounding.h;
-	}
-	while (info.bounding.h > 0)
-	{
-		if (!scanx(info.bounding.x, info.bounding.x + info.bounding.w, info.bounding.y + info.bounding.h - 1))
-			break;
-		--info.bounding.h;
+		int first, last;
+		if (!findAlphaRange(img->pixels + y * img->pitch, img->w, first, last))
+			continue;
+		top = min(top, y);
+		bottom = y;
+		left = min(left, first);
+		right = max(right, last);
 	}
+	info.bounding.y = top;
+	info.bounding.h = max(bottom - top + 1, 0);
 	info.bounding.h = max(info.bounding.h, 2);
 	info.bounding.y = min(info.bounding.y, info.rawheight - info.bounding.h);
-	//y axis
-	auto scany = [&](int y1, int y2, int x)
-	{
-		auto start = &data[y1 * img->pitch + 4 * x] + 3;
-		for (int y = y1; y < y2; y++)
-		{
-			if (*start > 0)
-				return false;
-			start += img->pitch;
-		}
-		return true;
-	};
-	while (info.bounding.x < info.rawwidth)
-	{
-		if (!scany(info.bounding.y, info.bounding.y + info.bounding.h, info.bounding.x))
-			break;
-		++info.bounding.x;
-		--info.bounding.w;
-	}
-	while (info.bounding.w > 0)
-	{
-		if (!scany(info.bounding.y, info.bounding.y + info.bounding.h, info.bounding.x + info.bounding.w - 1))
-			break;
-		--info.bounding.w;
-	}
+	info.bounding.x = left;
+	info.bounding.w = max(right - left + 1, 0);
 	info.bounding.w = max(info.bounding.w, 2);
 	info.bounding.x = min(info.bounding.x, info.rawwidth - info.bounding.w);
 	////alignment for 32
@@ -422,120 +608,399 @@ void findBounding(Img *img, ImageInfo& info)
 	//}
 }
 
+//gap between rects, extruded edges take it
+int getPackPadding()
+{
+	return 2 + 2 * options.extrude;
+}
+
+//rects start at 4*4 blocks for block texture formats
+int getPackAlign()
+{
+	return isBlockFormat((TextureFormat)options.texformat) ? 4 : 1;
+}
+
+//0 for ok, 1 for too large area, 2 for larger than maxwidth
+int checkImageSize(const ImageInfo &info)
+{
+	if (info.bounding.w * info.bounding.h > options.width * options.width)
+		return 1;
+	//Packer::pack rounds the padded size up to align, and the canvas only grows by padding
+	int padding = getPackPadding();
+	int align = getPackAlign();
+	int size = (max(info.bounding.w, info.bounding.h) + padding + align - 1) / align * align;
+	if (size > options.maxwidth + padding)
+		return 2;
+	return 0;
+}
+
+//crop img to bounding, and rotate it if needed
+Img *trimImage(Img *img, ImageInfo &info)
+{
+	ProfileScope scope(Profiler::PHASE_TRIM);
+	if (options.rot90 && info.bounding.h > info.bounding.w)
+	{
+		info.rot90 = true;
+		//save the rotated img
+		Img *src = new Img();
+		src->init(info.bounding.h, info.bounding.w);
+		//copy rot90 counterclockwise
+		rotate90((uint32_t*)img->pixels + img->w * info.bounding.y + info.bounding.x, img->w, info.bounding.w, info.bounding.h, (uint32_t*)src->pixels, src->w);
+		delete img;
+		//info.boundingoffset = { info.bounding.y, info.rawwidth - 1 - info.bounding.x - info.bounding.w };
+		info.boundingoffset = { info.bounding.x, info.bounding.y };	//offset at raw image
+		swap(info.bounding.w, info.bounding.h);
+		info.bounding.x = info.bounding.y = 0;
+		return src;
+	}
+	if (info.bounding.w == (int)img->w && info.bounding.h == (int)img->h)
+		return img;
+	//keep only the bounding part, bounding.x and bounding.y still are the offset at raw image
+	Img *src = new Img();
+	src->init(info.bounding.w, info.bounding.h);
+	for (int y = 0; y < info.bounding.h; y++)
+	{
+		memcpy(src->pixels + y * src->pitch, img->pixels + (info.bounding.y + y) * img->pitch + info.bounding.x * 4, src->pitch);
+	}
+	delete img;
+	return src;
+}
+
+void fillCacheEntry(PackCache::Entry &e, const ImageInfo &info)
+{
+	e.rawwidth = info.rawwidth;
+	e.rawheight = info.rawheight;
+	e.bounding[0] = info.bounding.x;
+	e.bounding[1] = info.bounding.y;
+	e.bounding[2] = info.bounding.w;
+	e.bounding[3] = info.bounding.h;
+	e.boundingoffset[0] = info.boundingoffset.x;
+	e.boundingoffset[1] = info.boundingoffset.y;
+	e.rot90 = info.rot90;
+}
+
 void loadAllImages()
 {
+	ProfileScope scope(Profiler::PHASE_LOAD);
 	ThreadPool &tp = ThreadPool::getInstance();
 	stat_info.maxHeight = 0;
 	stat_info.maxWidth = 0;
 	stat_info.totalArea = 0;
-	atomic<int> size = input_files.size();
-	for (auto it : input_files)
+	if (options.cache && packcache.open(cacheFileName(), getCacheFlags()))
 	{
-		tp.enqueue([&, it]() {
-			size--;
-			Img *img = new Img();
-			if (img->initWithFile(it))
+		wcout << "Use cache file " << cacheFileName() << endl;
+	}
+	if (options.cache || options.membudget)
+	{
+		if (!cachewriter.open(cacheWriterFileName()))
+			wcout << "fail to write cache file " << cacheWriterFileName() << endl;
+	}
+	outofcore = options.membudget && cachewriter.isOpen();
+	vector<wstring> files(input_files.begin(), input_files.end());
+	tp.parallel_for(0, files.size(), [&](size_t i) {
+		const wstring &it = files[i];
+		PackCache::Entry entry;
+		memset(&entry, 0, sizeof(entry));
+		const PackCache::Entry *cached = nullptr;
+		if (PackCache::getFileStat(it, entry.fileSize, entry.mtime))
+		{
+			cached = packcache.find(it, entry.fileSize, entry.mtime);
+		}
+		ImageInfo info;
+		info.filenames.push_back(it);
+		info.rot90 = false;
+		info.page = 0;
+		info.boundingoffset = { 0,0 };
+		if (cached)
+		{
+			info.rawwidth = cached->rawwidth;
+			info.rawheight = cached->rawheight;
+			info.bounding = { cached->bounding[0], cached->bounding[1], cached->bounding[2], cached->bounding[3] };
+			info.boundingoffset = { cached->boundingoffset[0], cached->boundingoffset[1] };
+			info.rot90 = cached->rot90 != 0;
+			//the image was ignored last time but options changed, or no hash in cache
+			if ((!cached->hasPixels && !checkImageSize(info)) || (options.compact && !cached->hasSha))
+				cached = nullptr;
+		}
+		Img *img = nullptr;
+		if (!cached)
+		{
+			img = new Img();
+			if (!img->initWithFile(it))
 			{
-				array<unsigned char, 32> sha;
-				if (options.compact)
-				{
-					using namespace picosha2;
-					hash256((unsigned char *)img->pixels, (unsigned char *)img->pixels + (img->w * img->h * 4), sha);
-					infomapmutex.lock();
-					auto it2 = hashedinfomap.find(sha);
-					if (it2 != hashedinfomap.end())
-					{
-						infomap[it2->second].filenames.push_back(it);
-						wcout << "Compact file ";
-						wcout << it;
-						wcout << "(" << infomap[it2->second].bounding.w << "*" << infomap[it2->second].bounding.h << ")" << endl;
-						infomapmutex.unlock();
-						delete img;
-						return;
-					}
-					infomapmutex.unlock();
-				}
-				ImageInfo info;
-				info.filenames.push_back(it);
-				info.rot90 = false;
-				info.rawwidth = img->w;
-				info.rawheight = img->h;
-				info.boundingoffset = { 0,0 };
-
-				findBounding(img, info);
-				if (info.bounding.w * info.bounding.h > options.width * options.width)
-				{
-					//sync wcout
-					infomapmutex.lock();
-					wcout << "Ignore large file ";
-					wcout << it;
-					wcout << "(" << info.bounding.w << "*" << info.bounding.h << ")" << endl;
-					infomapmutex.unlock();
-					delete img;
-				}
-				else if (max(info.bounding.w, info.bounding.h) > options.maxwidth)
-				{
-					//sync wcout
-					infomapmutex.lock();
-					wcout << "file ";
-					wcout << it;
-					wcout << "(" << info.bounding.w << "*" << info.bounding.h << ") is larger than maxwidth" << endl;
-					infomapmutex.unlock();
-					delete img;
-				}
-				else
-				{
-					if (options.rot90 && info.bounding.h > info.bounding.w)
-					{
-						info.rot90 = true;
-						//save the rotated img
-						Img *src = new Img();
-						src->init(info.bounding.h, info.bounding.w);
-						//copy rot90
-						for (int x = info.bounding.x; x < info.bounding.x + info.bounding.w; x++)
-						{
-							//rot 90 counterclockwise
-							int newy = info.bounding.w - 1 - (x - info.bounding.x);
-							for (int y = info.bounding.y; y < info.bounding.y + info.bounding.h; y++)
-							{
-								uint32_t *srcdata = (uint32_t*)img->pixels + img->w * y + x;
-								uint32_t *dstdata = (uint32_t*)src->pixels + src->w * newy + y - info.bounding.y;
-								*dstdata = *srcdata;
-							}
-						}
-						delete img;
-						img = src;
-						//info.boundingoffset = { info.bounding.y, info.rawwidth - 1 - info.bounding.x - info.bounding.w };
-						info.boundingoffset = { info.bounding.x, info.bounding.y };	//offset at raw image
-						swap(info.bounding.w, info.bounding.h);
-						info.bounding.x = info.bounding.y = 0;
-					}
-					infomapmutex.lock();
-					if (options.compact)
-					{
-						hashedinfomap[sha] = img;
-					}
-					infomap[img] = info;
-					stat_info.maxWidth = max(stat_info.maxWidth, info.bounding.w);
-					stat_info.maxHeight = max(stat_info.maxHeight, info.bounding.h);
-					stat_info.totalArea += info.bounding.w * info.bounding.h;
-
-					wcout << "Packed: ";
-					wcout << it;
-					wcout << "(" << info.bounding.w << "*" << info.bounding.h << ")" << endl;
-					infomapmutex.unlock();
-				}
+				delete img;
+				return;
+			}
+			info.rot90 = false;
+			info.rawwidth = img->w;
+			info.rawheight = img->h;
+			info.boundingoffset = { 0,0 };
+		}
+		array<unsigned char, 32> sha;
+		if (options.compact)
+		{
+			if (cached)
+			{
+				memcpy(sha.data(), cached->sha, 32);
 			}
 			else
 			{
+				ProfileScope scope(Profiler::PHASE_HASH);
+				using namespace picosha2;
+				hash256((unsigned char *)img->pixels, (unsigned char *)img->pixels + (img->w * img->h * 4), sha);
+			}
+			entry.hasSha = 1;
+			memcpy(entry.sha, sha.data(), 32);
+			infomapmutex.lock();
+			auto it2 = hashedinfomap.find(sha);
+			if (it2 != hashedinfomap.end())
+			{
+				infomap[it2->second].filenames.push_back(it);
+				cacheentries[it] = entry;
+				wcout << "Compact file ";
+				wcout << it;
+				wcout << "(" << infomap[it2->second].bounding.w << "*" << infomap[it2->second].bounding.h << ")" << endl;
+				infomapmutex.unlock();
 				delete img;
+				return;
+			}
+			infomapmutex.unlock();
+		}
+		if (!cached)
+		{
+			findBounding(img, info);
+		}
+		int sizeerr = checkImageSize(info);
+		if (sizeerr)
+		{
+			fillCacheEntry(entry, info);
+			//sync wcout
+			infomapmutex.lock();
+			cacheentries[it] = entry;
+			if (sizeerr == 1)
+			{
+				wcout << "Ignore large file ";
+				wcout << it;
+				wcout << "(" << info.bounding.w << "*" << info.bounding.h << ")" << endl;
 			}
-		});
+			else
+			{
+				wcout << "file ";
+				wcout << it;
+				wcout << "(" << info.bounding.w << "*" << info.bounding.h << ") is larger than maxwidth";
+				if (getPackPadding() > 2 || getPackAlign() > 1)
+					wcout << " with the padding of -extrude and the alignment of -texformat";
+				wcout << endl;
+			}
+			infomapmutex.unlock();
+			delete img;
+			return;
+		}
+		if (cached)
+		{
+			Profiler::count(Profiler::COUNTER_CACHE_HITS);
+			img = new Img();
+			if (outofcore)
+			{
+				//only the size is needed
+				img->w = info.bounding.w;
+				img->h = info.bounding.h;
+				img->pitch = img->w * 4;
+			}
+			else
+			{
+				img->init(info.bounding.w, info.bounding.h);
+				memcpy(img->pixels, packcache.getPixels(cached), img->pitch * img->h);
+			}
+		}
+		else
+		{
+			img = trimImage(img, info);
+		}
+		if (cachewriter.isOpen())
+		{
+			entry.pixelOffset = cachewriter.writePixels(cached ? packcache.getPixels(cached) : img->pixels, (uint64_t)img->pitch * img->h);
+			entry.hasPixels = 1;
+		}
+		if (outofcore && img->pixels)
+		{
+			delete[] img->pixels;
+			img->pixels = nullptr;
+		}
+		infomapmutex.lock();
+		if (options.compact)
+		{
+			hashedinfomap[sha] = img;
+		}
+		infomap[img] = info;
+		cacheentries[it] = entry;
+		stat_info.maxWidth = max(stat_info.maxWidth, info.bounding.w);
+		stat_info.maxHeight = max(stat_info.maxHeight, info.bounding.h);
+		stat_info.totalArea += info.bounding.w * info.bounding.h;
+
+		wcout << (cached ? "Packed(cached): " : "Packed: ");
+		wcout << it;
+		wcout << "(" << info.bounding.w << "*" << info.bounding.h << ")" << endl;
+		infomapmutex.unlock();
+	});
+	//the first of identical files is the one a thread loaded first, make it the smallest name
+	//the pixels in the cache go with it
+	if (options.compact)
+	{
+		for (auto &it : infomap)
+		{
+			auto &filenames = it.second.filenames;
+			wstring owner = filenames[0];
+			sort(filenames.begin(), filenames.end());
+			if (filenames[0] == owner)
+				continue;
+			auto &from = cacheentries[owner];
+			auto &to = cacheentries[filenames[0]];
+			to.hasPixels = from.hasPixels;
+			to.pixelOffset = from.pixelOffset;
+		}
+	}
+}
+
+//images sorted by file, so packing and data files don't depend on the order of infomap
+//a file belongs to one image only, so the order is total
+vector<ImageInfo *> getSortedInfos()
+{
+	map<wstring, ImageInfo *> sorted;
+	for (auto &it : infomap)
+	{
+		sorted[it.second.filenames[0]] = &it.second;
+	}
+	vector<ImageInfo *> res;
+	for (auto &it : sorted)
+	{
+		res.push_back(it.second);
+	}
+	return res;
+}
+
+//digest of everything decides the batch images, used to skip generating them if nothing changes
+array<unsigned char, 32> calcLayoutDigest()
+{
+	//sort by filename so the digest doesn't depend on the order of infomap
+	map<wstring, const ImageInfo *> sorted;
+	for (auto &it : infomap)
+	{
+		sorted[it.second.filenames[0]] = &it.second;
+	}
+	vector<int64_t> buf;
+	buf.push_back(getCacheFlags());
+	//settings which change pixels or bytes of batch images
+	buf.push_back(options.texformat);
+	buf.push_back(options.pnglevel);
+	buf.push_back(options.pngfilter);
+	buf.push_back(options.premultiply);
+	buf.push_back(options.extrude);
+	buf.push_back(options.alphableed);
+	for (auto &it : pages)
+	{
+		buf.push_back(it.w);
+		buf.push_back(it.h);
+	}
+	string names;
+	for (auto &it : sorted)
+	{
+		auto &info = *it.second;
+		auto &e = cacheentries[it.first];
+		names += UniToUTF8(it.first);
+		names.push_back(0);
+		buf.push_back(e.fileSize);
+		buf.push_back(e.mtime);
+		buf.push_back(info.page);
+		buf.push_back(info.bounding.x);
+		buf.push_back(info.bounding.y);
+		buf.push_back(info.bounding.w);
+		buf.push_back(info.bounding.h);
+		for (auto &r : info.split)
+		{
+			buf.push_back(r.x);
+			buf.push_back(r.y);
+			buf.push_back(r.w);
+			buf.push_back(r.h);
+		}
+		for (auto &r : info.dstRect)
+		{
+			buf.push_back(r.x);
+			buf.push_back(r.y);
+		}
 	}
-	while (size != 0)
+	names.append((const char *)buf.data(), buf.size() * sizeof(int64_t));
+	array<unsigned char, 32> res;
+	picosha2::hash256(names.begin(), names.end(), res);
+	return res;
+}
+
+bool isLayoutUnchanged(const array<unsigned char, 32> &layout)
+{
+	if (!packcache.hasLayout() || memcmp(packcache.getLayout(), layout.data(), 32))
+		return false;
+	for (int i = 0; i < (int)pages.size(); i++)
 	{
-		std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+		uint64_t fileSize;
+		int64_t mtime;
+		if (!PackCache::getFileStat(pageImageFileName(i), fileSize, mtime))
+			return false;
 	}
+	return true;
+}
+
+//write entries to the new cache file and replace the old one
+//for -membudget, the new one is mapped for blitting
+bool finishCacheFile(const array<unsigned char, 32> &layout)
+{
+	vector<pair<wstring, PackCache::Entry>> entries;
+	set<wstring> packed;
+	for (auto &it : infomap)
+	{
+		//linked files share pixels of the first one
+		auto &first = cacheentries[it.second.filenames[0]];
+		for (auto &filename : it.second.filenames)
+		{
+			PackCache::Entry e = cacheentries[filename];
+			fillCacheEntry(e, it.second);
+			e.hasPixels = first.hasPixels;
+			e.pixelOffset = first.pixelOffset;
+			entries.emplace_back(filename, e);
+			packed.insert(filename);
+		}
+	}
+	for (auto &it : cacheentries)
+	{
+		if (packed.count(it.first))
+			continue;
+		entries.emplace_back(it.first, it.second);
+	}
+	packcache.close();
+	if (!cachewriter.finish(getCacheFlags(), layout.data(), entries))
+	{
+		wcout << "fail to save cache file " << cacheWriterFileName() << endl;
+		return false;
+	}
+	wstring file = cacheWriterFileName();
+	if (options.cache)
+	{
+		if (!renameFile(file, cacheFileName()))
+		{
+			wcout << "fail to save cache file " << cacheFileName() << endl;
+			return false;
+		}
+		file = cacheFileName();
+	}
+	if (outofcore)
+		return packcache.open(file, getCacheFlags());
+	return true;
+}
+
+const unsigned char *getImagePixels(Img *img, const ImageInfo &info)
+{
+	if (img->pixels)
+		return img->pixels;
+	return packcache.getPixels(cacheentries.find(info.filenames[0])->second.pixelOffset);
 }
 
 void printImageBounding()
@@ -551,8 +1016,66 @@ void printImageBounding()
 	}
 }
 
-void calcCanvasSize(int &w, int &h)
+//for -tile, cut every image into tiles, and keep identical tiles only once in tiledict
+//tiles point to pixels of images, so it needs all images in memory
+void cutTiles()
 {
+	ProfileScope scope(Profiler::PHASE_TILE);
+	vector<pair<Img *, ImageInfo *>> todo;
+	for (auto &it : infomap)
+	{
+		todo.push_back({ it.first, &it.second });
+	}
+	//tile ids go by file, not by the order of infomap
+	sort(todo.begin(), todo.end(), [](const pair<Img *, ImageInfo *> &a, const pair<Img *, ImageInfo *> &b) {
+		return a.second->filenames[0] < b.second->filenames[0];
+	});
+	//hash in parallel, then add in order
+	vector<vector<uint64_t>> hashes(todo.size());
+	ThreadPool::getInstance().parallel_for(0, todo.size(), [&](size_t n) {
+		Img *img = todo[n].first;
+		ImageInfo &info = *todo[n].second;
+		info.split.clear();
+		info.tiles.clear();
+		for (int y = 0; y < (int)img->h; y += options.tile)
+		{
+			for (int x = 0; x < (int)img->w; x += options.tile)
+			{
+				Rect r = { x, y, min(options.tile, (int)img->w - x), min(options.tile, (int)img->h - y) };
+				info.split.push_back(r);
+				hashes[n].push_back(TileDict::hashTile(img->pixels + y * img->pitch + x * 4, img->pitch, r.w, r.h));
+			}
+		}
+	});
+	tiledict.clear();
+	size_t total = 0;
+	for (size_t n = 0; n < todo.size(); n++)
+	{
+		Img *img = todo[n].first;
+		ImageInfo &info = *todo[n].second;
+		for (size_t i = 0; i < info.split.size(); i++)
+		{
+			auto &r = info.split[i];
+			info.tiles.push_back(tiledict.add(img->pixels + r.y * img->pitch + r.x * 4, img->pitch, r.w, r.h, hashes[n][i]));
+		}
+		total += info.split.size();
+	}
+	Profiler::count(Profiler::COUNTER_TILES, total);
+	Profiler::count(Profiler::COUNTER_UNIQUE_TILES, tiledict.size());
+	wcout << "Cut " << total << " tiles, " << tiledict.size() << " unique" << endl;
+}
+
+void calcCanvasSize(const vector<PackItem> &items, int &w, int &h)
+{
+	stat_info.maxHeight = 0;
+	stat_info.maxWidth = 0;
+	stat_info.totalArea = 0;
+	for (auto &it : items)
+	{
+		stat_info.maxWidth = max(stat_info.maxWidth, it.w);
+		stat_info.maxHeight = max(stat_info.maxHeight, it.h);
+		stat_info.totalArea += it.w * it.h;
+	}
 	int len = nextPOT(1.1 * sqrt(stat_info.totalArea));
 	if (!options.split)
 	{
@@ -571,119 +1094,227 @@ void calcCanvasSize(int &w, int &h)
 	h = max(h, 32);
 }
 
-void clearRectsInfo()
+struct PackResult
 {
-	for (auto &it : infomap)
+	int w = 0, h = 0;
+	Packer::Method method = Packer::SHELF;
+	bool all = false;
+	int placedArea = 0;
+	vector<PackItem> items;
+};
+
+//which packer usually leaves the least waste, used when canvases are the same
+int methodRank(Packer::Method method)
+{
+	switch (method)
 	{
-		it.second.dstRect.clear();
+	case Packer::MAXRECTS_CP:
+		return 0;
+	case Packer::MAXRECTS_BSSF:
+		return 1;
+	case Packer::SKYLINE:
+		return 2;
+	default:
+		return 3;
 	}
 }
 
-int findLeft(map<int, int>& LT, int t)
+//all placed beats partly placed, then the one fills the canvas best
+//for partly placed ones, more placed area means less pages
+bool isBetterResult(const PackResult &a, const PackResult &b)
 {
-	auto it = LT.upper_bound(t);
-	if (it == LT.end())
-		return 0;
-	return it->second;
+	if (a.all != b.all)
+		return a.all;
+	if (!a.all && a.placedArea != b.placedArea)
+		return a.placedArea > b.placedArea;
+	if (a.w * a.h != b.w * b.h)
+		return a.w * a.h < b.w * b.h;
+	return methodRank(a.method) < methodRank(b.method);
 }
 
-bool doWithoutSplit(int w, int h)
+//canvases smaller than the estimate which may still hold everything
+//the estimate leaves room for waste, a good packer often needs less
+void addSmallerSizes(int w, int h, vector<PageInfo> &sizes)
 {
-	//find imgs with large h
-	vector<ImageInfo*> LHimgs;
-	//the rest
-	vector<ImageInfo*> NMimgs;
-	for (auto &it : infomap)
+	const PageInfo smaller[] = { { w, h / 2 }, { w / 2, h } };
+	for (auto &sz : smaller)
+	{
+		if (sz.w < 32 || sz.h < 32)
+			continue;
+		if (sz.w < stat_info.maxWidth || sz.h < stat_info.maxHeight || sz.w * sz.h < stat_info.totalArea)
+			continue;
+		sizes.push_back(sz);
+	}
+}
+
+//try every candidate canvas size with every packer in parallel, and keep the best layout
+//candidates go from a bit under the estimate up to maxwidth
+bool packPage(const vector<PackItem> &rest, PackResult &best)
+{
+	int w, h;
+	calcCanvasSize(rest, w, h);
+	w = min(w, options.maxwidth);
+	h = min(h, options.maxwidth);
+	vector<PageInfo> sizes;
+	addSmallerSizes(w, h, sizes);
+	for (;;)
 	{
-		if (it.second.bounding.h >= h / 2)
+		sizes.push_back({ w, h });
+		if (w >= options.maxwidth && h >= options.maxwidth)
+			break;
+		if (w != h)
 		{
-			LHimgs.push_back(&it.second);
+			w = max(w, h);
+			h = max(w, h);
 		}
 		else
 		{
-			NMimgs.push_back(&it.second);
+			w *= 2;
 		}
 	}
-	bool retryonce = false;
-retry:
-	sort(LHimgs.begin(), LHimgs.end(), [](ImageInfo* a, ImageInfo* b)
+	vector<PackResult> results;
+	for (auto &sz : sizes)
 	{
-		return a->bounding.h < b->bounding.h || (a->bounding.h == b->bounding.h && a->bounding.w < b->bounding.w);
+		for (int m = 0; m < Packer::METHOD_COUNT; m++)
+		{
+			//contact point scoring is quadratic in image count
+			if (m == Packer::MAXRECTS_CP && rest.size() > 1000)
+				continue;
+			PackResult res;
+			res.w = sz.w;
+			res.h = sz.h;
+			res.method = (Packer::Method)m;
+			results.push_back(std::move(res));
+		}
+	}
+	int padding = getPackPadding();
+	int align = getPackAlign();
+	ThreadPool::getInstance().parallel_for(0, results.size(), [&](size_t i) {
+		ProfileScope scope(Profiler::PHASE_PACK_ATTEMPT);
+		PackResult &res = results[i];
+		res.items = rest;
+		res.all = Packer::create(res.method)->pack(res.w, res.h, padding, res.items, align);
+		res.placedArea = 0;
+		for (auto &it : res.items)
+		{
+			if (it.placed)
+				res.placedArea += it.w * it.h;
+		}
 	});
-	sort(NMimgs.begin(), NMimgs.end(), [](ImageInfo* a, ImageInfo* b)
+	bool found = false;
+	for (auto &res : results)
 	{
-		return a->bounding.h < b->bounding.h || (a->bounding.h == b->bounding.h && a->bounding.w < b->bounding.w);
-	});
-	map<int, int> LT;
-	//put all LHimgs to left
-	int left = 0;
-	for (auto it = LHimgs.rbegin(); it != LHimgs.rend(); ++it)
-	{
-		(*it)->dstRect.push_back({ left, 0, (*it)->bounding.w,(*it)->bounding.h });
-		LT[(*it)->bounding.h] = left + (*it)->bounding.w;
-		left += (*it)->bounding.w;
-		//
-		left += 2;
-	}
-	//then we fill rest part
-	int linetop = 0;
-	int lineheight = 0;
-	left = findLeft(LT, linetop);
-	for (auto it = NMimgs.begin(); it != NMimgs.end();)
-	{
-		if (left + (*it)->bounding.w <= w)
-		{
-			if (linetop + (*it)->bounding.h > h)
-			{
-				//retry
-				if (retryonce)
-					return false;
-				retryonce = true;
-				LT.clear();
-				//set all these imgs as LHimgs
-				LHimgs.insert(LHimgs.end(), it, NMimgs.end());
-				NMimgs.erase(it, NMimgs.end());
-				clearRectsInfo();
-				goto retry;
-			}
-			(*it)->dstRect.push_back({ left, linetop, (*it)->bounding.w,(*it)->bounding.h });
-			lineheight = max(lineheight, (*it)->bounding.h);
-			left += (*it)->bounding.w;
-			//
-			left += 2;
-			++it;
-		}
-		else if (lineheight > 0)
-		{
-			linetop += lineheight;
-			//
-			linetop += 2;
-			lineheight = 0;
-			left = findLeft(LT, linetop);
-			continue;
+		if (res.placedArea > 0 && (!found || isBetterResult(res, best)))
+		{
+			best = std::move(res);
+			found = true;
 		}
-		else
+	}
+	return found;
+}
+
+//for -tile, unique tiles are packed instead of images
+//images whose tiles don't all fit go to the next page, and their tiles are packed again there
+//tiles placed only for those images are left blank
+bool packAllTiles()
+{
+	vector<ImageInfo *> rest = getSortedInfos();
+	for (auto info : rest)
+	{
+		info->dstRect.clear();
+	}
+	pages.clear();
+	while (!rest.empty())
+	{
+		vector<PackItem> items;
+		vector<bool> used(tiledict.size(), false);
+		for (auto info : rest)
 		{
-			//rest width is not enough
-			auto it2 = LT.begin();
-			while (it2 != LT.end())
-			{
-				if (it2->second + (*it)->bounding.w <= w)
-					break;
-				++it2;
-			}
-			if (it2 == LT.end())
-				return false;
-			if (w < (*it)->bounding.w || it2->first + (*it)->bounding.h + 2 > h)
-				return false;
-			linetop = it2->first;
-			linetop += 2;
-			lineheight = 0;
-			left = findLeft(LT, linetop);
-			continue;
+			for (int t : info->tiles)
+			{
+				if (used[t])
+					continue;
+				used[t] = true;
+				items.push_back({ tiledict[t].w, tiledict[t].h, (void *)(intptr_t)t, false, { 0,0,0,0 } });
+			}
 		}
+		PackResult best;
+		if (!packPage(items, best))
+			return false;
+		vector<const PackItem *> placed(tiledict.size(), nullptr);
+		for (auto &it : best.items)
+		{
+			if (it.placed)
+				placed[(intptr_t)it.userdata] = &it;
+		}
+		int page = pages.size();
+		vector<ImageInfo *> next;
+		for (auto info : rest)
+		{
+			bool all = true;
+			for (int t : info->tiles)
+			{
+				if (!placed[t])
+					all = false;
+			}
+			if (!all)
+			{
+				next.push_back(info);
+				continue;
+			}
+			info->page = page;
+			for (int t : info->tiles)
+			{
+				info->dstRect.push_back(placed[t]->dst);
+			}
+		}
+		//no image fits in a whole page
+		if (next.size() == rest.size())
+			return false;
+		pages.push_back({ best.w, best.h });
+		wcout << "Page " << page << ": " << best.w << " * " << best.h << " by " << Packer::methodName(best.method) << endl;
+		rest.swap(next);
 	}
-	return true;
+	return !pages.empty();
+}
+
+bool packAll()
+{
+	ProfileScope scope(Profiler::PHASE_PACK);
+	if (options.tile > 0)
+		return packAllTiles();
+	vector<PackItem> rest;
+	for (auto info : getSortedInfos())
+	{
+		info->dstRect.clear();
+		rest.push_back({ info->bounding.w, info->bounding.h, info, false, { 0,0,0,0 } });
+	}
+	pages.clear();
+	while (!rest.empty())
+	{
+		PackResult best;
+		if (!packPage(rest, best))
+			return false;
+		int page = pages.size();
+		vector<PackItem> next;
+		for (auto &it : best.items)
+		{
+			if (it.placed)
+			{
+				ImageInfo *info = (ImageInfo *)it.userdata;
+				info->page = page;
+				info->dstRect.push_back(it.dst);
+			}
+			else
+			{
+				next.push_back(it);
+			}
+		}
+		pages.push_back({ best.w, best.h });
+		wcout << "Page " << page << ": " << best.w << " * " << best.h << " by " << Packer::methodName(best.method) << endl;
+		rest.swap(next);
+	}
+	return !pages.empty();
 }
 
 #undef min
@@ -701,15 +1332,13 @@ void drawRectAt(unsigned char *dst, uint32_t dstWidth, uint32_t dstHeight, const
 		height = (int32_t)(std::min(srcRectHeight, dstHeight - y));
 	else
 		height = (int32_t)std::min(srcRectHeight + y, dstHeight);
-	int32_t srcskip = 4 * (srcWidth - width);
-	int32_t dstskip = 4 * (dstWidth - width);
-	if (!width || !height)
+	if (width <= 0 || height <= 0)
 		return;
 	int32_t base, base2;
 	base = y > 0 ? y*dstWidth : 0;
 	base += x > 0 ? x : 0;
 	base *= 4;
-	base2 = y < 0 ? -y*srcRectWidth : 0;
+	base2 = y < 0 ? -y*srcWidth : 0;
 	base2 -= x < 0 ? x : 0;
 	base2 += srcRectY * srcWidth;
 	base2 += srcRectX;
@@ -717,70 +1346,171 @@ void drawRectAt(unsigned char *dst, uint32_t dstWidth, uint32_t dstHeight, const
 
 	while (height--)
 	{
-		int32_t ww = (width + 3) / 4;
-		switch (width & 3)
+		memcpy(&dst[base], &src[base2], width * 4);
+		base += 4 * dstWidth;
+		base2 += 4 * srcWidth;
+	}
+}
+
+//for -extrude and --alphableed, copy the rect with its edges repeated around it and draw the copy
+void drawRectExtruded(Img *canvas, const unsigned char *src, uint32_t srcWidth, uint32_t srcRectX, uint32_t srcRectY, int w, int h, int32_t x, int32_t y)
+{
+	int n = options.extrude;
+	int ew = w + 2 * n;
+	int eh = h + 2 * n;
+	vector<uint32_t> buf((size_t)ew * eh);
+	for (int j = 0; j < eh; j++)
+	{
+		int sy = min(max(j - n, 0), h - 1);
+		const uint32_t *row = (const uint32_t *)src + (size_t)(srcRectY + sy) * srcWidth + srcRectX;
+		uint32_t *d = &buf[(size_t)j * ew];
+		for (int i = 0; i < n; i++)
 		{
-		case 0:
-			do
-			{
-				*(int32_t*)&dst[base] = *(int32_t*)&src[base2];
-				base += 4; base2 += 4;
-		case 3:
-			*(int32_t*)&dst[base] = *(int32_t*)&src[base2];
-			base += 4; base2 += 4;
-		case 2:
-			*(int32_t*)&dst[base] = *(int32_t*)&src[base2];
-			base += 4; base2 += 4;
-		case 1:
-			*(int32_t*)&dst[base] = *(int32_t*)&src[base2];
-			base += 4; base2 += 4;
-			} while (--ww > 0);
+			d[i] = row[0];
+			d[n + w + i] = row[w - 1];
 		}
-		base += dstskip;
-		base2 += srcskip;
+		memcpy(d + n, row, w * 4);
 	}
+	if (options.alphableed)
+		bleedAlpha((unsigned char *)buf.data(), ew, eh, 16);
+	drawRectAt(canvas->pixels, canvas->w, canvas->h, (const unsigned char *)buf.data(), ew, eh, 0, 0, ew, eh, x - n, y - n);
 }
 
-
-Img *blitImages(int w, int h)
+//draw images of page on canvas, canvas starts at line top of the page
+void drawImagesAt(Img *canvas, int page, int top)
 {
-	wcout << "Generating batch image..." << endl;
-	Img *batch = new Img();
-	batch->init(w, h);
-	batch->clear();
-	ThreadPool &tp = ThreadPool::getInstance();
-	atomic<int> size = infomap.size();
-	for (auto it : infomap)
+	ProfileScope scope(Profiler::PHASE_BLIT);
+	struct Blit
+	{
+		Img *src;
+		const ImageInfo *info;
+		//index in split, -1 for the whole image
+		int part;
+	};
+	vector<Blit> todo;
+	//for -tile, images share tiles, every tile is drawn once
+	set<pair<int, int>> drawn;
+	for (auto &it : infomap)
 	{
-		tp.enqueue([&, it]() {
-			size--;
-			Img *src = it.first;
-			if (it.second.split.empty())
+		if (it.second.page != page)
+			continue;
+		auto &info = it.second;
+		for (int i = 0; i < (int)info.dstRect.size(); i++)
+		{
+			auto &r = info.dstRect[i];
+			if (r.y - options.extrude >= top + (int)canvas->h || r.y + r.h + options.extrude <= top)
+				continue;
+			if (info.split.empty())
 			{
-				drawRectAt(batch->pixels, batch->w, batch->h, src->pixels, src->w, src->h, it.second.bounding.x, it.second.bounding.y, it.second.bounding.w, it.second.bounding.h, it.second.dstRect.back().x, it.second.dstRect.back().y);
+				todo.push_back({ it.first, &info, -1 });
 			}
-			else
+			else if (drawn.insert({ r.x, r.y }).second)
 			{
-				for (int i = 0; i < it.second.split.size(); i++)
-				{
-					drawRectAt(batch->pixels, batch->w, batch->h, src->pixels, src->w, src->h, it.second.split[i].x, it.second.split[i].y, it.second.split[i].w, it.second.split[i].h, it.second.dstRect[i].x, it.second.dstRect[i].y);
-				}
+				todo.push_back({ it.first, &info, i });
 			}
-		});
-	}
-	while (size != 0)
-	{
-		std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+		}
 	}
+	//rects don't overlap, so they can be drawn at the same time
+	ThreadPool::getInstance().parallel_for(0, todo.size(), [&](size_t n) {
+		Img *src = todo[n].src;
+		const ImageInfo &info = *todo[n].info;
+		const unsigned char *pixels = getImagePixels(src, info);
+		int i = todo[n].part;
+		if (options.extrude > 0 || options.alphableed)
+		{
+			const Rect &r = i < 0 ? info.dstRect.back() : info.dstRect[i];
+			int sx = i < 0 ? 0 : info.split[i].x;
+			int sy = i < 0 ? 0 : info.split[i].y;
+			drawRectExtruded(canvas, pixels, src->w, sx, sy, r.w, r.h, r.x, r.y - top);
+		}
+		else if (i < 0)
+		{
+			//src only keeps the bounding part
+			drawRectAt(canvas->pixels, canvas->w, canvas->h, pixels, src->w, src->h, 0, 0, info.bounding.w, info.bounding.h, info.dstRect.back().x, info.dstRect.back().y - top);
+		}
+		else
+		{
+			drawRectAt(canvas->pixels, canvas->w, canvas->h, pixels, src->w, src->h, info.split[i].x, info.split[i].y, info.split[i].w, info.split[i].h, info.dstRect[i].x, info.dstRect[i].y - top);
+		}
+	});
+}
+
+Img *blitImages(int page)
+{
+	wcout << "Generating batch image " << page << "..." << endl;
+	Img *batch = new Img();
+	batch->init(pages[page].w, pages[page].h);
+	batch->clear();
+	drawImagesAt(batch, page, 0);
 	return batch;
 }
 
-void saveImageFile(Img *img)
+wstring pageFileName(int page)
 {
-	img->saveImageToPNG(options.output + L".png", false);
+	if (page == 0)
+		return options.output;
+	return options.output + L"_" + to_wstring(page);
+}
+
+//with the extension of -texformat
+wstring pageImageFileName(int page)
+{
+	return pageFileName(page) + getTextureExtension((TextureFormat)options.texformat);
+}
+
+void saveImageFile(Img *img, int page)
+{
+	ProfileScope scope(Profiler::PHASE_ENCODE);
+	if (options.premultiply)
+		premultiplyAlpha(img->pixels, img->w * img->h);
+	if (options.texformat == TEXTURE_PNG)
+	{
+		img->saveImageToPNG(pageImageFileName(page), false, options.pnglevel, options.pngfilter);
+	}
+	else
+	{
+		TextureWriter writer;
+		if (!writer.begin(pageImageFileName(page), (TextureFormat)options.texformat, img->w, img->h) || !writer.writeRows(img->pixels, img->h) || !writer.end())
+			wcout << "fail to save " << pageImageFileName(page) << endl;
+	}
 	delete img;
 }
 
+//for -membudget, blit and encode the batch image by strips of lines
+bool saveImageFileInStrips(int page)
+{
+	wcout << "Generating batch image " << page << " by strips..." << endl;
+	int w = pages[page].w;
+	int h = pages[page].h;
+	//half of the budget for the strip, the rest for mapped pixels of images
+	int rows = (int)min((int64_t)h, max((int64_t)16, options.membudget / 2 / (w * 4)));
+	//whole lines of blocks for texture formats, h is a power of two
+	rows -= rows % 4;
+	bool png = options.texformat == TEXTURE_PNG;
+	PNGEncoder encoder(options.pnglevel, (PNGEncoder::Filter)options.pngfilter);
+	TextureWriter writer;
+	if (png ? !encoder.begin(pageImageFileName(page), w, h, 4) : !writer.begin(pageImageFileName(page), (TextureFormat)options.texformat, w, h))
+		return false;
+	Img *strip = new Img();
+	strip->init(w, rows);
+	for (int top = 0; top < h; top += rows)
+	{
+		strip->clear();
+		drawImagesAt(strip, page, top);
+		ProfileScope scope(Profiler::PHASE_ENCODE);
+		int n = min(rows, h - top);
+		if (options.premultiply)
+			premultiplyAlpha(strip->pixels, w * n);
+		if (png)
+			encoder.writeRows(strip->pixels, n);
+		else
+			writer.writeRows(strip->pixels, n);
+	}
+	delete strip;
+	ProfileScope scope(Profiler::PHASE_ENCODE);
+	return png ? encoder.end() : writer.end();
+}
+
 void saveListFile()
 {
 	u16string res;
@@ -801,6 +1531,47 @@ void saveListFile()
 	_globalStructures.writeFunc(res, UniToUTF16(options.outlistfile), 0);
 }
 
+//rects of the image in dstRect order, in the raw image, or in the raw image rotated for rot90
+vector<Rect> getRectsInImage(const ImageInfo &info)
+{
+	vector<Rect> res;
+	if (info.split.empty())
+	{
+		if (info.rot90)
+		{
+			res.push_back({ info.boundingoffset.x, info.boundingoffset.y, info.bounding.h, info.bounding.w });
+		}
+		else
+		{
+			res.push_back({ info.bounding.x, info.bounding.y, info.bounding.w, info.bounding.h });
+		}
+	}
+	else
+	{
+		for (auto &it : info.split)
+		{
+			if (info.rot90)
+			{
+				res.push_back({ info.bounding.h - it.y - it.h + info.boundingoffset.x, it.x + info.boundingoffset.y, it.h, it.w });
+			}
+			else
+			{
+				//split is in the trimmed image
+				res.push_back({ it.x + info.bounding.x, it.y + info.bounding.y, it.w, it.h });
+			}
+		}
+	}
+	return res;
+}
+
+//file of the batch image without directory
+wstring pageImageBaseName(int page)
+{
+	wstring file = pageImageFileName(page);
+	size_t pos = file.find_last_of(L"/\\");
+	return pos == wstring::npos ? file : file.substr(pos + 1);
+}
+
 void saveToBagelFile()
 {
 	auto v = new Bagel_Array();
@@ -810,6 +1581,7 @@ void saveToBagelFile()
 	Bagel_StringHolder rectsInBatch = W("rectsInBatch");
 	Bagel_StringHolder rot90 = W("rot90");
 	Bagel_StringHolder link = W("link");
+	Bagel_StringHolder pageid = W("page");
 	int dirlen = options.dir.size();
 	for (auto &it : infomap)
 	{
@@ -819,31 +1591,14 @@ void saveToBagelFile()
 		d->setMember(name, UniToUTF16(filename.substr(dirlen)));
 		d->setMember(size, { info.rawwidth, info.rawheight });
 		d->setMember(rot90, info.rot90);
-		auto r = new Bagel_Array();
-		if (info.split.empty())
+		if (pages.size() > 1)
 		{
-			if (info.rot90)
-			{
-				r->pushMember({ info.boundingoffset.x, info.boundingoffset.y, info.bounding.h, info.bounding.w });
-			}
-			else
-			{
-				r->pushMember({ info.bounding.x, info.bounding.y, info.bounding.w, info.bounding.h });
-			}
+			d->setMember(pageid, info.page);
 		}
-		else
+		auto r = new Bagel_Array();
+		for (auto &it2 : getRectsInImage(info))
 		{
-			for (auto &it2 : info.split)
-			{
-				if (info.rot90)
-				{
-					r->pushMember({ info.bounding.h - it2.y - it2.h + info.boundingoffset.x, it2.x + info.boundingoffset.y, it2.h, it2.w });
-				}
-				else
-				{
-					r->pushMember({ it2.x, it2.y, it2.w, it2.h });
-				}
-			}
+			r->pushMember({ it2.x, it2.y, it2.w, it2.h });
 		}
 		d->setMember(rects, r);
 		auto rb = new Bagel_Array();
@@ -868,16 +1623,132 @@ void saveToBagelFile()
 	res.saveToFile(UniToUTF16(options.output + L".bkpsr"), true);
 }
 
-void saveToFile(Img *img)
+string toJsonString(const wstring &str)
+{
+	string res = "\"";
+	for (unsigned char c : UniToUTF8(str))
+	{
+		if (c == '"' || c == '\\')
+		{
+			res.push_back('\\');
+			res.push_back(c);
+		}
+		else if (c < 0x20)
+		{
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			res += buf;
+		}
+		else
+		{
+			res.push_back(c);
+		}
+	}
+	res.push_back('"');
+	return res;
+}
+
+string toJsonRect(const Rect &r)
+{
+	return "[" + to_string(r.x) + ", " + to_string(r.y) + ", " + to_string(r.w) + ", " + to_string(r.h) + "]";
+}
+
+//same content as bkpsr, plus the pages
+bool saveToJsonFile()
 {
-	saveImageFile(img);
+	int dirlen = options.dir.size();
+	string res = "{\n\t\"pages\": [";
+	for (int i = 0; i < (int)pages.size(); i++)
+	{
+		res += i ? ",\n" : "\n";
+		res += "\t\t{ \"file\": " + toJsonString(pageImageBaseName(i)) + ", \"w\": " + to_string(pages[i].w) + ", \"h\": " + to_string(pages[i].h) + " }";
+	}
+	res += "\n\t],\n\t\"images\": [";
+	bool first = true;
+	for (auto info : getSortedInfos())
+	{
+		res += first ? "\n" : ",\n";
+		first = false;
+		res += "\t\t{ \"name\": " + toJsonString(info->filenames[0].substr(dirlen));
+		res += ", \"size\": [" + to_string(info->rawwidth) + ", " + to_string(info->rawheight) + "]";
+		res += ", \"rot90\": ";
+		res += info->rot90 ? "true" : "false";
+		res += ", \"page\": " + to_string(info->page);
+		res += ", \"rects\": [";
+		auto rects = getRectsInImage(*info);
+		for (size_t i = 0; i < rects.size(); i++)
+		{
+			res += (i ? ", " : "") + toJsonRect(rects[i]);
+		}
+		res += "], \"rectsInBatch\": [";
+		for (size_t i = 0; i < info->dstRect.size(); i++)
+		{
+			res += (i ? ", " : "") + toJsonRect(info->dstRect[i]);
+		}
+		res += "]";
+		if (info->filenames.size() > 1)
+		{
+			res += ", \"link\": [";
+			for (size_t i = 1; i < info->filenames.size(); i++)
+			{
+				res += (i > 1 ? ", " : "") + toJsonString(info->filenames[i].substr(dirlen));
+			}
+			res += "]";
+		}
+		res += " }";
+	}
+	res += "\n\t]\n}\n";
+	return writeFile(options.output + L".json", res);
+}
+
+//the index for AtlasIndex, images are sorted by file
+bool saveToBinaryFile()
+{
+	int dirlen = options.dir.size();
+	AtlasIndexWriter writer;
+	for (int i = 0; i < (int)pages.size(); i++)
+	{
+		writer.addPage(UniToUTF8(pageImageBaseName(i)), pages[i].w, pages[i].h);
+	}
+	for (auto info : getSortedInfos())
+	{
+		vector<string> names;
+		for (auto &filename : info->filenames)
+		{
+			names.push_back(UniToUTF8(filename.substr(dirlen)));
+		}
+		auto src = getRectsInImage(*info);
+		vector<AtlasIndex::Rect> rects;
+		for (size_t i = 0; i < info->dstRect.size(); i++)
+		{
+			auto &d = info->dstRect[i];
+			rects.push_back({ src[i].x, src[i].y, src[i].w, src[i].h, d.x, d.y, d.w, d.h });
+		}
+		writer.addSprite(names, info->rawwidth, info->rawheight, info->page, info->rot90, rects);
+	}
+	return writer.save(options.output + L".atlasidx");
+}
+
+void saveToFile()
+{
+	ProfileScope scope(Profiler::PHASE_SAVE_DATA);
 	saveListFile();
 	switch (options.format)
 	{
 	case options.FMT_BKE:
 		saveToBagelFile();
 		break;
-
+	case options.FMT_JSON:
+		if (!saveToJsonFile())
+			wcout << "fail to save " << options.output << ".json" << endl;
+		break;
+	case options.FMT_BIN:
+		if (!saveToBinaryFile())
+			wcout << "fail to save " << options.output << ".atlasidx" << endl;
+		break;
+	default:
+		wcout << "plist is not supported yet, no data file is saved" << endl;
+		break;
 	}
 }
 
@@ -911,47 +1782,104 @@ int wmain(int argc, wchar_t ** argv)
 	}
 	initOption();
 	readOption(argc, argv);
-	getFiles(options.dir);
+	ThreadPool::setThreadCount(options.threads);
+	if (options.profile)
+		Profiler::enable();
+	{
+		ProfileScope scope(Profiler::PHASE_GETFILES);
+		getFiles(options.dir);
+	}
+	Profiler::count(Profiler::COUNTER_FILES, input_files.size());
 	loadAllImages();
+	Profiler::count(Profiler::COUNTER_IMAGES, infomap.size());
+	if (options.tile > 0)
+	{
+		if (outofcore)
+		{
+			wcout << "-tile is ignored with -membudget" << endl;
+			options.tile = 0;
+		}
+		else
+		{
+			cutTiles();
+		}
+	}
 
 	//printImageBounding();
-	int w, h;
-	calcCanvasSize(w, h);
-
-	if (w > options.maxwidth || h > options.maxwidth)
+	if (!packAll())
 		goto fail;
-	bool res = doWithoutSplit(w, h);
-	while (!res && (w < 2048 || h < 2048))
 	{
-		if (w != h)
+		auto layout = calcLayoutDigest();
+		bool unchanged = options.cache && isLayoutUnchanged(layout);
+		if (cachewriter.isOpen() && !finishCacheFile(layout) && outofcore)
+			goto fail;
+		//for -membudget, the new cache is mapped by finishCacheFile for blitting
+		if (!outofcore)
+			packcache.close();
+		if (unchanged)
 		{
-			w = max(w, h);
-			h = max(w, h);
+			wcout << "Layout is unchanged, skip generating batch image" << endl;
 		}
 		else
 		{
-			w *= 2;
+			{
+				//a page is encoded while the next one is blitted, so at most two batch images are in memory
+				TaskGroup encoding;
+				for (int i = 0; i < (int)pages.size(); i++)
+				{
+					if (outofcore)
+					{
+						if (!saveImageFileInStrips(i))
+							goto fail;
+						continue;
+					}
+					Img *batch = blitImages(i);
+					if (!batch)
+						goto fail;
+					encoding.wait();
+					encoding.run([batch, i]() {
+						saveImageFile(batch, i);
+					});
+				}
+				encoding.wait();
+			}
+			for (int i = 0; i < (int)pages.size(); i++)
+			{
+				uint64_t fileSize;
+				int64_t mtime;
+				if (PackCache::getFileStat(pageImageFileName(i), fileSize, mtime))
+					Profiler::count(Profiler::COUNTER_OUTPUT_BYTES, fileSize);
+			}
 		}
-		clearRectsInfo();
-		res = doWithoutSplit(w, h);
+		packcache.close();
+		if (outofcore && !options.cache)
+			removeFile(cacheWriterFileName());
 	}
-	if (!res)
+	saveToFile();
+	Profiler::count(Profiler::COUNTER_PAGES, pages.size());
+	wcout << "pack success!" << endl;
+	for (auto &it : pages)
 	{
-		goto fail;
+		wcout << "Pack image size " << it.w << " * " << it.h << endl;
 	}
-	Img *batch = blitImages(w, h);
-	if (!batch)
-		goto fail;
-	saveToFile(batch);
-	wcout << "pack success!" << endl;
-	wcout << "Pack image size " << w << " * " << h << endl;
 	goto end;
 
 fail:
 	wcout << "fail to pack iamges, maybe too many images to pack" << endl;
+	packcache.close();
+	cachewriter.close();
+	if (outofcore && !options.cache)
+		removeFile(cacheWriterFileName());
 
 
 end:
+	if (options.profile)
+	{
+		if (Profiler::saveReport(options.output + L".profile.json"))
+			wcout << "Profile is saved to " << options.output << ".profile.json" << endl;
+		else
+			wcout << "fail to save profile " << options.output << ".profile.json" << endl;
+	}
 	releaseImgs();
     return 0;
 }
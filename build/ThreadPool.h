@@ -1,76 +1,294 @@
 #pragma once
 
 #include <vector>
-#include <queue>
+#include <deque>
 #include <memory>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
 #include <future>
 #include <functional>
 #include <stdexcept>
+#include <exception>
+#include <algorithm>
 
+//count down to zero, then wait() returns
+class Latch
+{
+public:
+	explicit Latch(int count)
+	: count(count)
+	{
+	}
+
+	void countDown()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--count <= 0)
+			cv.notify_all();
+	}
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [this] { return count <= 0; });
+	}
+
+private:
+	int count;
+	std::mutex mutex;
+	std::condition_variable cv;
+
+	// noncopyable
+	Latch(const Latch&) = delete;
+	Latch &operator = (const Latch&) = delete;
+};
+
+//work-stealing pool, every worker owns a deque
+//a worker pushes and pops its own jobs at the back, and idle ones steal from the front of others
+//jobs from other threads are dealt to the deques in turn, and sleeping workers are woken by condition variable
 class ThreadPool
 {
+	friend class TaskGroup;
 	void init(int threads);
 public:
 	static ThreadPool &getInstance();
+	//number of threads including the caller, 0 for the count of cores
+	//with 1, every job runs in the thread which queues it
+	//must be called before the first getInstance
+	static void setThreadCount(int count);
 	ThreadPool();
 	template<class F, class... Args>
 	auto enqueue(F&& f, Args&&... args)
 		->std::future<typename std::result_of<F(Args...)>::type>;
+	//call f(i) for every i in [begin, end), the caller works too and returns when all are done
+	//the first exception thrown by f is thrown again in caller
+	template<class F>
+	void parallel_for(size_t begin, size_t end, F &&f);
+	//run one queued job in the calling thread, return false if there's none
+	bool runPendingTask();
+	size_t getWorkerCount() const
+	{
+		return workers.size();
+	}
 	~ThreadPool();
 private:
+	struct TaskQueue
+	{
+		std::deque< std::function<void()> > tasks;
+		std::mutex mutex;
+	};
+
+	void push(std::function<void()> &&task);
+	bool pop(int self, std::function<void()> &task);
+	static int &threadCount();
+	//index of the worker running on this thread, -1 for other threads
+	static int &currentWorker();
+
 	// need to keep track of threads so we can join them
 	std::vector< std::thread > workers;
-	// the task queue
-	std::queue< std::function<void()> > tasks;
+	// one task queue for each worker
+	std::vector< std::unique_ptr<TaskQueue> > queues;
+	std::atomic<unsigned> nextQueue;
+	//jobs in all queues
+	std::atomic<int> pending;
+	std::atomic<int> sleeping;
 
 	// synchronization
-	std::mutex queue_mutex;
+	std::mutex sleep_mutex;
+	std::condition_variable wakeup;
 	bool stop;
 };
-// the constructor just launches some amount of workers
-void ThreadPool::init(int threads)
+
+//jobs run on the pool, wait() returns after all of them are done
+//the waiting thread runs queued jobs meanwhile, so groups can be nested in jobs
+class TaskGroup
+{
+public:
+	explicit TaskGroup(ThreadPool &pool = ThreadPool::getInstance())
+	: pool(pool)
+	, count(0)
+	{
+	}
+	~TaskGroup()
+	{
+		join();
+	}
+
+	template<class F>
+	void run(F &&f)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			count++;
+		}
+		typename std::decay<F>::type func(std::forward<F>(f));
+		pool.push([this, func]() mutable {
+			try
+			{
+				func();
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error)
+					error = std::current_exception();
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--count == 0)
+				cv.notify_all();
+		});
+	}
+	//the first exception thrown by jobs is thrown again here
+	void wait()
+	{
+		join();
+		std::exception_ptr e;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			e = error;
+			error = nullptr;
+		}
+		if (e)
+			std::rethrow_exception(e);
+	}
+
+private:
+	void join()
+	{
+		for (;;)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (count == 0)
+					return;
+			}
+			if (pool.runPendingTask())
+				continue;
+			//the rest are running on other threads
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [this] { return count == 0; });
+			return;
+		}
+	}
+
+	ThreadPool &pool;
+	int count;
+	std::exception_ptr error;
+	std::mutex mutex;
+	std::condition_variable cv;
+
+	// noncopyable
+	TaskGroup(const TaskGroup&) = delete;
+	TaskGroup &operator = (const TaskGroup&) = delete;
+};
+
+//no worker is started for 0 threads, jobs run in the pushing thread then
+inline void ThreadPool::init(int threads)
 {
-	if (threads < 1)
+	if (threads < 0)
 	{
-		threads = 1;
+		threads = 0;
 	}
 	stop = false;
-	for (size_t i = 0; i < threads; ++i)
+	nextQueue = 0;
+	pending = 0;
+	sleeping = 0;
+	for (int i = 0; i < threads; ++i)
+		queues.emplace_back(new TaskQueue());
+	for (int i = 0; i < threads; ++i)
 		workers.emplace_back(
-			[this]
+			[this, i]
 	{
+		currentWorker() = i;
 		for (;;)
 		{
 			std::function<void()> task;
+			if (pop(i, task))
 			{
-				std::unique_lock<std::mutex> lock(this->queue_mutex);
-				if (this->tasks.empty())
-				{
-					if (this->stop)
-						return;
-					else
-						goto _sleep;
-				}
-				task = std::move(this->tasks.front());
-				this->tasks.pop();
+				task();
+				continue;
 			}
-			task();
-			continue;
-		_sleep:
-			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			std::unique_lock<std::mutex> lock(this->sleep_mutex);
+			sleeping++;
+			this->wakeup.wait(lock, [this] { return this->stop || this->pending > 0; });
+			sleeping--;
+			if (this->stop && this->pending == 0)
+				return;
 		}
 	}
 	);
 }
 
+inline void ThreadPool::push(std::function<void()> &&task)
+{
+	if (queues.empty())
+	{
+		task();
+		return;
+	}
+	int self = currentWorker();
+	size_t i = self >= 0 ? self : nextQueue++ % queues.size();
+	{
+		std::lock_guard<std::mutex> lock(queues[i]->mutex);
+		queues[i]->tasks.push_back(std::move(task));
+	}
+	pending++;
+	//a worker going to sleep checks pending after increasing sleeping, so no wakeup is lost
+	if (sleeping > 0)
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		wakeup.notify_one();
+	}
+}
+
+inline bool ThreadPool::pop(int self, std::function<void()> &task)
+{
+	if (pending <= 0)
+		return false;
+	size_t n = queues.size();
+	if (self >= 0)
+	{
+		auto &q = *queues[self];
+		std::lock_guard<std::mutex> lock(q.mutex);
+		if (!q.tasks.empty())
+		{
+			task = std::move(q.tasks.back());
+			q.tasks.pop_back();
+			pending--;
+			return true;
+		}
+	}
+	size_t start = self >= 0 ? self + 1 : nextQueue.load();
+	for (size_t k = 0; k < n; k++)
+	{
+		auto &q = *queues[(start + k) % n];
+		std::lock_guard<std::mutex> lock(q.mutex);
+		if (!q.tasks.empty())
+		{
+			task = std::move(q.tasks.front());
+			q.tasks.pop_front();
+			pending--;
+			return true;
+		}
+	}
+	return false;
+}
+
+inline bool ThreadPool::runPendingTask()
+{
+	std::function<void()> task;
+	if (!pop(currentWorker(), task))
+		return false;
+	task();
+	return true;
+}
+
 #if !defined (_WIN32) && !defined (_WIN64)
 #ifndef LINUX
 #define LINUX
 #endif
-#include <sysconf.h>  
+#include <unistd.h>  
 #else
 #ifndef WINDOWS
 #define WINDOWS
@@ -90,15 +308,34 @@ inline unsigned getCoreCount()
 	return count;
 }
 
-ThreadPool & ThreadPool::getInstance()
+inline int &ThreadPool::threadCount()
+{
+	static int count = 0;
+	return count;
+}
+
+inline int &ThreadPool::currentWorker()
+{
+	static thread_local int index = -1;
+	return index;
+}
+
+inline void ThreadPool::setThreadCount(int count)
+{
+	threadCount() = count;
+}
+
+inline ThreadPool & ThreadPool::getInstance()
 {
 	static ThreadPool tp;
 	return tp;
 }
 
+//the caller thread is one of them, so -j 1 starts no worker
 inline ThreadPool::ThreadPool()
 {
-	init(getCoreCount()-1);
+	int count = threadCount() > 0 ? threadCount() : (int)getCoreCount();
+	init(count - 1);
 }
 
 // add new work item to the pool
@@ -112,19 +349,73 @@ auto ThreadPool::enqueue(F&& f, Args&&... args)
 		);
 
 	std::future<return_type> res = task->get_future();
-	{
-		std::unique_lock<std::mutex> lock(queue_mutex);
-		tasks.emplace([task]() { (*task)(); });
-	}
+	push([task]() { (*task)(); });
 	return res;
 }
+
+template<class F>
+void ThreadPool::parallel_for(size_t begin, size_t end, F &&f)
+{
+	if (begin >= end)
+		return;
+	//a few chunks for each thread, so threads finishing early can take more
+	size_t count = end - begin;
+	size_t grain = std::max<size_t>(1, count / ((workers.size() + 1) * 4));
+	size_t chunks = (count + grain - 1) / grain;
+	struct State
+	{
+		explicit State(int chunks)
+		: next(0)
+		, done(chunks)
+		{
+		}
+		std::atomic<size_t> next;
+		Latch done;
+		std::mutex mutex;
+		std::exception_ptr error;
+	};
+	auto state = std::make_shared<State>((int)chunks);
+	//f is only touched for a valid chunk, and the caller waits for all of them, so a reference is fine
+	auto work = [state, &f, begin, end, grain, chunks]() {
+		for (;;)
+		{
+			size_t c = state->next++;
+			if (c >= chunks)
+				return;
+			size_t from = begin + c * grain;
+			size_t to = (std::min)(end, from + grain);
+			try
+			{
+				for (size_t i = from; i < to; i++)
+					f(i);
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock(state->mutex);
+				if (!state->error)
+					state->error = std::current_exception();
+			}
+			state->done.countDown();
+		}
+	};
+	size_t helpers = (std::min)(workers.size(), chunks - 1);
+	for (size_t i = 0; i < helpers; i++)
+		push(work);
+	work();
+	//chunks not finished yet are running on other threads
+	state->done.wait();
+	if (state->error)
+		std::rethrow_exception(state->error);
+}
+
 // the destructor joins all threads
 inline ThreadPool::~ThreadPool()
 {
 	{
-		std::unique_lock<std::mutex> lock(queue_mutex);
+		std::unique_lock<std::mutex> lock(sleep_mutex);
 		stop = true;
 	}
+	wakeup.notify_all();
 	for (std::thread &worker : workers)
 		worker.join();
-}
\ No newline at end of file
+}
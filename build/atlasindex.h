@@ -0,0 +1,247 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+//reader of the binary atlas index (-format bin), saved as filename.atlasidx
+//file layout: Header | Page[pageCount] | Sprite[spriteCount] | Rect[rectCount] | Name[nameCount]
+//             | uint32 bucket seeds[bucketCount] | uint32 slots[nameCount] | utf8 strings
+//every table has fixed-size records and starts at a multiple of 4, numbers are little endian
+//the file is made to be mapped and used in place, a name is found by a minimal perfect hash
+//with one hash, one probe and one string compare, and nothing is allocated
+//this header only needs the C library, so it can be copied into the runtime
+class AtlasIndex
+{
+public:
+	enum
+	{
+		VERSION = 1,
+	};
+
+	enum
+	{
+		SPRITE_ROT90 = 1,
+	};
+
+	struct Header
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t fileSize;
+		uint32_t pageCount;
+		uint32_t spriteCount;
+		uint32_t rectCount;
+		//names of sprites and of files linked to them, every one is a key of the hash
+		uint32_t nameCount;
+		uint32_t bucketCount;
+		uint32_t pagesOffset;
+		uint32_t spritesOffset;
+		uint32_t rectsOffset;
+		uint32_t namesOffset;
+		uint32_t bucketsOffset;
+		uint32_t slotsOffset;
+		uint32_t stringsOffset;
+		uint32_t stringsSize;
+	};
+
+	//in the string table, followed by a 0
+	struct String
+	{
+		uint32_t offset;
+		uint32_t length;
+	};
+
+	struct Page
+	{
+		//file of the batch image, without directory
+		String file;
+		uint32_t w, h;
+	};
+
+	struct Sprite
+	{
+		uint32_t rawWidth, rawHeight;
+		uint32_t page;
+		uint32_t flags;
+		uint32_t firstRect, rectCount;
+		//the first name is the file of the sprite, the others are files linked to it
+		uint32_t firstName, nameCount;
+	};
+
+	//same as "rects" and "rectsInBatch" of bkpsr
+	struct Rect
+	{
+		int32_t x, y, w, h;
+		int32_t dstX, dstY, dstW, dstH;
+	};
+
+	struct Name
+	{
+		String name;
+		uint32_t sprite;
+	};
+
+	//bucket of a name is hash(name, 0) % bucketCount, its slot is hash(name, seed of bucket) % nameCount
+	//the writer uses it too, change VERSION if it's changed
+	static uint32_t hash(const char *str, size_t len, uint32_t seed)
+	{
+		//FNV-1a from a seeded basis, then the finalizer of murmur3
+		uint64_t h = 14695981039346656037ULL ^ ((uint64_t)seed * 0x9E3779B97F4A7C15ULL);
+		for (size_t i = 0; i < len; i++)
+		{
+			h ^= (unsigned char)str[i];
+			h *= 1099511628211ULL;
+		}
+		h ^= h >> 33;
+		h *= 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 33;
+		h *= 0xC4CEB9FE1A85EC53ULL;
+		h ^= h >> 33;
+		return (uint32_t)h;
+	}
+
+	AtlasIndex()
+	: base(nullptr)
+	, header(nullptr)
+	{
+	}
+
+	//data is the whole file and must live as long as this object, e.g. a mapped view
+	//every table and record is checked once here, so getters and find() trust them
+	bool init(const void *data, size_t size)
+	{
+		base = nullptr;
+		header = nullptr;
+		if (!data || size < sizeof(Header) || ((uintptr_t)data & 3))
+			return false;
+		const Header *h = (const Header *)data;
+		if (memcmp(h->magic, "BKAI", 4) || h->version != VERSION || h->fileSize < sizeof(Header) || h->fileSize > size || h->bucketCount == 0)
+			return false;
+		if (!checkTable(h, h->pagesOffset, h->pageCount, sizeof(Page))
+			|| !checkTable(h, h->spritesOffset, h->spriteCount, sizeof(Sprite))
+			|| !checkTable(h, h->rectsOffset, h->rectCount, sizeof(Rect))
+			|| !checkTable(h, h->namesOffset, h->nameCount, sizeof(Name))
+			|| !checkTable(h, h->bucketsOffset, h->bucketCount, sizeof(uint32_t))
+			|| !checkTable(h, h->slotsOffset, h->nameCount, sizeof(uint32_t))
+			|| !checkTable(h, h->stringsOffset, h->stringsSize, 1))
+			return false;
+		base = (const unsigned char *)data;
+		header = h;
+		if (!checkRecords())
+		{
+			base = nullptr;
+			header = nullptr;
+			return false;
+		}
+		return true;
+	}
+
+	bool isValid() const
+	{
+		return header != nullptr;
+	}
+
+	uint32_t getPageCount() const
+	{
+		return header->pageCount;
+	}
+	const Page &getPage(uint32_t i) const
+	{
+		return table<Page>(header->pagesOffset)[i];
+	}
+
+	uint32_t getSpriteCount() const
+	{
+		return header->spriteCount;
+	}
+	const Sprite &getSprite(uint32_t i) const
+	{
+		return table<Sprite>(header->spritesOffset)[i];
+	}
+	const Rect *getRects(const Sprite &s) const
+	{
+		return table<Rect>(header->rectsOffset) + s.firstRect;
+	}
+
+	uint32_t getNameCount() const
+	{
+		return header->nameCount;
+	}
+	const Name &getName(uint32_t i) const
+	{
+		return table<Name>(header->namesOffset)[i];
+	}
+	const char *getString(const String &s) const
+	{
+		return (const char *)base + header->stringsOffset + s.offset;
+	}
+
+	//name is utf8 and relative to the input directory, same as in bkpsr
+	//return nullptr if not found
+	const Sprite *find(const char *name, size_t len) const
+	{
+		if (!header->nameCount)
+			return nullptr;
+		uint32_t bucket = hash(name, len, 0) % header->bucketCount;
+		uint32_t seed = table<uint32_t>(header->bucketsOffset)[bucket];
+		uint32_t slot = hash(name, len, seed) % header->nameCount;
+		const Name &n = getName(table<uint32_t>(header->slotsOffset)[slot]);
+		if (n.name.length != len || memcmp(getString(n.name), name, len))
+			return nullptr;
+		return &getSprite(n.sprite);
+	}
+	const Sprite *find(const char *name) const
+	{
+		return find(name, strlen(name));
+	}
+
+private:
+	//tables are after the header and inside fileSize
+	static bool checkTable(const Header *h, uint32_t offset, uint32_t count, size_t size)
+	{
+		return !(offset & 3) && offset >= sizeof(Header) && (uint64_t)offset + (uint64_t)count * size <= h->fileSize;
+	}
+
+	//a string and its 0 are inside the string table
+	bool checkString(const String &s) const
+	{
+		return (uint64_t)s.offset + s.length < header->stringsSize && !getString(s)[s.length];
+	}
+
+	//every index in a record points into its table
+	bool checkRecords() const
+	{
+		for (uint32_t i = 0; i < header->pageCount; i++)
+		{
+			if (!checkString(getPage(i).file))
+				return false;
+		}
+		for (uint32_t i = 0; i < header->spriteCount; i++)
+		{
+			const Sprite &s = getSprite(i);
+			if (s.page >= header->pageCount || s.nameCount == 0
+				|| (uint64_t)s.firstRect + s.rectCount > header->rectCount
+				|| (uint64_t)s.firstName + s.nameCount > header->nameCount)
+				return false;
+		}
+		for (uint32_t i = 0; i < header->nameCount; i++)
+		{
+			const Name &n = getName(i);
+			if (n.sprite >= header->spriteCount || !checkString(n.name))
+				return false;
+			if (table<uint32_t>(header->slotsOffset)[i] >= header->nameCount)
+				return false;
+		}
+		return true;
+	}
+
+	template<class T>
+	const T *table(uint32_t offset) const
+	{
+		return (const T *)(base + offset);
+	}
+
+	const unsigned char *base;
+	const Header *header;
+};
@@ -0,0 +1,230 @@
+//standalone round-trip test of the binary atlas index, not a part of ImagePacker
+//build on linux:
+//  g++ -std=c++14 -O2 -fsanitize=address atlasindextest.cpp atlasindexwriter.cpp <bkutf8 source> -o atlasindextest
+//sprites are made like ImagePacker makes them from infomap, built by AtlasIndexWriter and read back by AtlasIndex
+//exit code is the count of failures
+#include "atlasindexwriter.h"
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <random>
+
+using namespace std;
+
+static int failures = 0;
+static int checks = 0;
+
+static void check(bool ok, const char *what, const string &name)
+{
+	checks++;
+	if (ok)
+		return;
+	failures++;
+	if (failures <= 20)
+		printf("FAIL %s: %s\n", what, name.c_str());
+}
+
+//what ImagePacker takes from ImageInfo
+struct TestSprite
+{
+	vector<string> names;
+	uint32_t rawWidth, rawHeight;
+	uint32_t page;
+	bool rot90;
+	vector<AtlasIndex::Rect> rects;
+};
+
+struct TestPage
+{
+	string file;
+	uint32_t w, h;
+};
+
+static void makeAtlas(mt19937 &rng, int count, vector<TestPage> &pages, vector<TestSprite> &sprites)
+{
+	pages = { { "out.png", 2048, 2048 }, { "out_1.png", 1024, 512 }, { "out_2.png", 64, 64 } };
+	for (int i = 0; i < count; i++)
+	{
+		TestSprite s;
+		//utf8 and nested directories like files under -d
+		s.names.push_back("ui/" + to_string(i % 13) + "/\xE5\x9B\xBE" + to_string(i) + ".png");
+		//-compact links identical files to the first one
+		if (i % 5 == 0)
+		{
+			for (int k = 0; k <= i % 3; k++)
+				s.names.push_back("copy" + to_string(k) + "/" + to_string(i) + ".png");
+		}
+		s.rawWidth = rng() % 500 + 1;
+		s.rawHeight = rng() % 500 + 1;
+		s.page = rng() % pages.size();
+		s.rot90 = i % 3 == 0;
+		//one rect for a whole image, more for --enablesplit or -tile
+		int n = i % 4 == 0 ? (int)(rng() % 6) + 2 : 1;
+		for (int k = 0; k < n; k++)
+		{
+			int32_t w = rng() % 64 + 1, h = rng() % 64 + 1;
+			AtlasIndex::Rect r = { (int32_t)(rng() % 400), (int32_t)(rng() % 400), w, h, 0, 0, 0, 0 };
+			r.dstX = rng() % 1000;
+			r.dstY = rng() % 1000;
+			r.dstW = s.rot90 ? h : w;
+			r.dstH = s.rot90 ? w : h;
+			s.rects.push_back(r);
+		}
+		sprites.push_back(s);
+	}
+}
+
+static bool build(const vector<TestPage> &pages, const vector<TestSprite> &sprites, vector<unsigned char> &data)
+{
+	AtlasIndexWriter writer;
+	for (auto &p : pages)
+		writer.addPage(p.file, p.w, p.h);
+	for (auto &s : sprites)
+		writer.addSprite(s.names, s.rawWidth, s.rawHeight, s.page, s.rot90, s.rects);
+	return writer.build(data);
+}
+
+static void testRoundTrip(int count)
+{
+	mt19937 rng(count);
+	vector<TestPage> pages;
+	vector<TestSprite> sprites;
+	makeAtlas(rng, count, pages, sprites);
+	vector<unsigned char> data;
+	check(build(pages, sprites, data), "build", to_string(count));
+	//copy to memory aligned like a mapped file
+	vector<uint32_t> aligned((data.size() + 3) / 4);
+	memcpy(aligned.data(), data.data(), data.size());
+	AtlasIndex index;
+	check(index.init(aligned.data(), data.size()), "init", to_string(count));
+	if (!index.isValid())
+		return;
+
+	check(index.getPageCount() == pages.size(), "page count", to_string(count));
+	for (uint32_t i = 0; i < index.getPageCount() && i < pages.size(); i++)
+	{
+		auto &p = index.getPage(i);
+		check(index.getString(p.file) == pages[i].file && p.file.length == pages[i].file.size(), "page file", pages[i].file);
+		check(p.w == pages[i].w && p.h == pages[i].h, "page size", pages[i].file);
+	}
+	check(index.getSpriteCount() == sprites.size(), "sprite count", to_string(count));
+	for (size_t i = 0; i < sprites.size(); i++)
+	{
+		auto &s = sprites[i];
+		auto *found = index.find(s.names[0].c_str());
+		check(found == &index.getSprite((uint32_t)i), "find", s.names[0]);
+		if (!found)
+			continue;
+		check(found->rawWidth == s.rawWidth && found->rawHeight == s.rawHeight, "raw size", s.names[0]);
+		check(found->page == s.page, "page", s.names[0]);
+		check(((found->flags & AtlasIndex::SPRITE_ROT90) != 0) == s.rot90, "rot90", s.names[0]);
+		check(found->rectCount == s.rects.size(), "rect count", s.names[0]);
+		if (found->rectCount == s.rects.size())
+			check(!memcmp(index.getRects(*found), s.rects.data(), s.rects.size() * sizeof(AtlasIndex::Rect)), "rects", s.names[0]);
+		check(found->nameCount == s.names.size(), "name count", s.names[0]);
+		for (uint32_t k = 0; k < found->nameCount && k < s.names.size(); k++)
+		{
+			auto &n = index.getName(found->firstName + k);
+			check(string(index.getString(n.name), n.name.length) == s.names[k], "name", s.names[k]);
+			check(n.sprite == i, "name sprite", s.names[k]);
+			//linked files resolve to the sprite of the first one
+			check(index.find(s.names[k].c_str(), s.names[k].size()) == found, "find link", s.names[k]);
+		}
+		//names which are not in the index
+		string other = s.names[0] + "x";
+		check(!index.find(other.c_str()), "find missing", other);
+		check(!index.find(s.names[0].c_str(), s.names[0].size() - 1), "find prefix", s.names[0]);
+	}
+	check(!index.find(""), "find empty", "");
+	//a cut file is refused
+	check(!AtlasIndex().init(aligned.data(), data.size() - 1), "init cut", to_string(count));
+}
+
+static void testEmpty()
+{
+	AtlasIndexWriter writer;
+	vector<unsigned char> data;
+	check(writer.build(data), "build empty", "");
+	vector<uint32_t> aligned((data.size() + 3) / 4);
+	memcpy(aligned.data(), data.data(), data.size());
+	AtlasIndex index;
+	check(index.init(aligned.data(), data.size()), "init empty", "");
+	if (index.isValid())
+	{
+		check(index.getSpriteCount() == 0 && index.getPageCount() == 0, "empty counts", "");
+		check(!index.find("a.png"), "find in empty", "a.png");
+	}
+}
+
+static void testDuplicates()
+{
+	vector<unsigned char> data;
+	//the same file twice, and a link which is also a sprite
+	AtlasIndexWriter writer;
+	writer.addSprite({ "a.png", "a.png" }, 1, 1, 0, false, {});
+	check(!writer.build(data), "duplicate link", "a.png");
+	AtlasIndexWriter writer2;
+	writer2.addSprite({ "a.png", "b.png" }, 1, 1, 0, false, {});
+	writer2.addSprite({ "b.png" }, 1, 1, 0, false, {});
+	check(!writer2.build(data), "duplicate sprite", "b.png");
+}
+
+//every broken field must be refused by init, so find and the getters never read outside the file
+static void testCorrupt()
+{
+	mt19937 rng(5);
+	vector<TestPage> pages;
+	vector<TestSprite> sprites;
+	makeAtlas(rng, 50, pages, sprites);
+	vector<unsigned char> data;
+	check(build(pages, sprites, data), "build corrupt", "");
+	vector<uint32_t> clean((data.size() + 3) / 4);
+	memcpy(clean.data(), data.data(), data.size());
+	auto h = *(const AtlasIndex::Header *)clean.data();
+	uint32_t lastSprite = h.spritesOffset + (h.spriteCount - 1) * sizeof(AtlasIndex::Sprite);
+	uint32_t lastName = h.namesOffset + (h.nameCount - 1) * sizeof(AtlasIndex::Name);
+	struct Corruption
+	{
+		const char *what;
+		size_t offset;
+		uint32_t value;
+	} corruptions[] = {
+		{ "fileSize", offsetof(AtlasIndex::Header, fileSize), (uint32_t)data.size() + 4 },
+		{ "fileSize under header", offsetof(AtlasIndex::Header, fileSize), 8 },
+		{ "table in header", offsetof(AtlasIndex::Header, rectsOffset), 4 },
+		{ "stringsSize", offsetof(AtlasIndex::Header, stringsSize), h.stringsSize + 4 },
+		{ "sprite page", lastSprite + offsetof(AtlasIndex::Sprite, page), h.pageCount },
+		{ "sprite rects", lastSprite + offsetof(AtlasIndex::Sprite, rectCount), h.rectCount + 1 },
+		{ "sprite firstRect", lastSprite + offsetof(AtlasIndex::Sprite, firstRect), 0xFFFFFFFF },
+		{ "sprite names", lastSprite + offsetof(AtlasIndex::Sprite, nameCount), h.nameCount + 1 },
+		{ "sprite no name", lastSprite + offsetof(AtlasIndex::Sprite, nameCount), 0 },
+		{ "name sprite", lastName + offsetof(AtlasIndex::Name, sprite), h.spriteCount },
+		{ "name string", lastName + offsetof(AtlasIndex::Name, name.offset), h.stringsSize - 1 },
+		{ "name length", lastName + offsetof(AtlasIndex::Name, name.length), 0xFFFFFFFF },
+		{ "name without 0", lastName + offsetof(AtlasIndex::Name, name.length), 0 },
+		{ "page file", h.pagesOffset + offsetof(AtlasIndex::Page, file.offset), h.stringsSize },
+		{ "slot", h.slotsOffset, h.nameCount },
+	};
+	for (auto &c : corruptions)
+	{
+		vector<uint32_t> broken = clean;
+		memcpy((unsigned char *)broken.data() + c.offset, &c.value, 4);
+		AtlasIndex index;
+		check(!index.init(broken.data(), data.size()), "init corrupt", c.what);
+		check(!index.isValid(), "valid corrupt", c.what);
+	}
+	check(AtlasIndex().init(clean.data(), data.size()), "init clean", "");
+}
+
+int main()
+{
+	for (int count : { 1, 2, 7, 100, 20000 })
+		testRoundTrip(count);
+	testEmpty();
+	testDuplicates();
+	testCorrupt();
+	printf("%d checks, %d failures\n", checks, failures);
+	return failures;
+}
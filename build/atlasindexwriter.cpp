@@ -0,0 +1,180 @@
+#include "atlasindexwriter.h"
+#include <stdio.h>
+#include <algorithm>
+#include <unordered_set>
+#include "../Bagel/Engine/bkutf8.h"
+#undef min
+#undef max
+
+using namespace std;
+
+//average names in a bucket, more is smaller but slower to build
+static const uint32_t bucketSize = 2;
+//give up a bucket after so many seeds, only happens with a broken hash
+static const uint32_t maxSeed = 1 << 24;
+
+AtlasIndex::String AtlasIndexWriter::addString(const string &str)
+{
+	AtlasIndex::String s;
+	s.offset = (uint32_t)strings.size();
+	s.length = (uint32_t)str.size();
+	strings += str;
+	strings.push_back(0);
+	return s;
+}
+
+void AtlasIndexWriter::addPage(const string &file, uint32_t w, uint32_t h)
+{
+	AtlasIndex::Page p;
+	p.file = addString(file);
+	p.w = w;
+	p.h = h;
+	pages.push_back(p);
+}
+
+void AtlasIndexWriter::addSprite(const vector<string> &spriteNames, uint32_t rawWidth, uint32_t rawHeight, uint32_t page, bool rot90, const vector<AtlasIndex::Rect> &spriteRects)
+{
+	AtlasIndex::Sprite s;
+	s.rawWidth = rawWidth;
+	s.rawHeight = rawHeight;
+	s.page = page;
+	s.flags = rot90 ? AtlasIndex::SPRITE_ROT90 : 0;
+	s.firstRect = (uint32_t)rects.size();
+	s.rectCount = (uint32_t)spriteRects.size();
+	s.firstName = (uint32_t)names.size();
+	s.nameCount = (uint32_t)spriteNames.size();
+	rects.insert(rects.end(), spriteRects.begin(), spriteRects.end());
+	for (auto &it : spriteNames)
+	{
+		AtlasIndex::Name n;
+		n.name = addString(it);
+		n.sprite = (uint32_t)sprites.size();
+		names.push_back(n);
+	}
+	sprites.push_back(s);
+}
+
+//hash and displace: names are put into buckets by one hash, then from the largest bucket,
+//find a seed for every bucket that sends all its names to free slots
+bool AtlasIndexWriter::buildHash(vector<uint32_t> &buckets, vector<uint32_t> &slots) const
+{
+	uint32_t n = (uint32_t)names.size();
+	uint32_t bucketCount = n / bucketSize + 1;
+	buckets.assign(bucketCount, 0);
+	slots.assign(n, n);
+	vector<vector<uint32_t>> members(bucketCount);
+	for (uint32_t i = 0; i < n; i++)
+	{
+		const char *s = strings.data() + names[i].name.offset;
+		members[AtlasIndex::hash(s, names[i].name.length, 0) % bucketCount].push_back(i);
+	}
+	vector<uint32_t> order(bucketCount);
+	for (uint32_t i = 0; i < bucketCount; i++)
+		order[i] = i;
+	stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+		return members[a].size() > members[b].size();
+	});
+	vector<uint32_t> tried;
+	for (uint32_t b : order)
+	{
+		auto &m = members[b];
+		if (m.empty())
+			break;
+		bool found = false;
+		for (uint32_t seed = 1; seed < maxSeed && !found; seed++)
+		{
+			tried.clear();
+			found = true;
+			for (uint32_t i : m)
+			{
+				uint32_t slot = AtlasIndex::hash(strings.data() + names[i].name.offset, names[i].name.length, seed) % n;
+				if (slots[slot] != n || find(tried.begin(), tried.end(), slot) != tried.end())
+				{
+					found = false;
+					break;
+				}
+				tried.push_back(slot);
+			}
+			if (found)
+			{
+				buckets[b] = seed;
+				for (size_t k = 0; k < m.size(); k++)
+					slots[tried[k]] = m[k];
+			}
+		}
+		if (!found)
+			return false;
+	}
+	return true;
+}
+
+bool AtlasIndexWriter::build(vector<unsigned char> &out) const
+{
+	unordered_set<string> unique;
+	for (auto &it : names)
+	{
+		if (!unique.insert(string(strings.data() + it.name.offset, it.name.length)).second)
+			return false;
+	}
+	vector<uint32_t> buckets, slots;
+	if (!buildHash(buckets, slots))
+		return false;
+
+	AtlasIndex::Header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, "BKAI", 4);
+	h.version = AtlasIndex::VERSION;
+	h.pageCount = (uint32_t)pages.size();
+	h.spriteCount = (uint32_t)sprites.size();
+	h.rectCount = (uint32_t)rects.size();
+	h.nameCount = (uint32_t)names.size();
+	h.bucketCount = (uint32_t)buckets.size();
+	h.stringsSize = (uint32_t)strings.size();
+	//every record is made of 4 byte fields, so tables stay aligned
+	uint32_t offset = sizeof(h);
+	auto place = [&](uint32_t &tableOffset, size_t bytes) {
+		tableOffset = offset;
+		offset += (uint32_t)((bytes + 3) & ~(size_t)3);
+	};
+	place(h.pagesOffset, pages.size() * sizeof(AtlasIndex::Page));
+	place(h.spritesOffset, sprites.size() * sizeof(AtlasIndex::Sprite));
+	place(h.rectsOffset, rects.size() * sizeof(AtlasIndex::Rect));
+	place(h.namesOffset, names.size() * sizeof(AtlasIndex::Name));
+	place(h.bucketsOffset, buckets.size() * sizeof(uint32_t));
+	place(h.slotsOffset, slots.size() * sizeof(uint32_t));
+	place(h.stringsOffset, strings.size());
+	h.fileSize = offset;
+
+	out.assign(offset, 0);
+	auto copy = [&](uint32_t tableOffset, const void *data, size_t bytes) {
+		if (bytes)
+			memcpy(&out[tableOffset], data, bytes);
+	};
+	copy(0, &h, sizeof(h));
+	copy(h.pagesOffset, pages.data(), pages.size() * sizeof(AtlasIndex::Page));
+	copy(h.spritesOffset, sprites.data(), sprites.size() * sizeof(AtlasIndex::Sprite));
+	copy(h.rectsOffset, rects.data(), rects.size() * sizeof(AtlasIndex::Rect));
+	copy(h.namesOffset, names.data(), names.size() * sizeof(AtlasIndex::Name));
+	copy(h.bucketsOffset, buckets.data(), buckets.size() * sizeof(uint32_t));
+	copy(h.slotsOffset, slots.data(), slots.size() * sizeof(uint32_t));
+	copy(h.stringsOffset, strings.data(), strings.size());
+	return true;
+}
+
+bool AtlasIndexWriter::save(const wstring &path) const
+{
+	vector<unsigned char> data;
+	if (!build(data))
+		return false;
+#ifdef _WIN32
+	FILE *f = _wfopen(path.c_str(), L"wb");
+#else
+	FILE *f = fopen(UniToUTF8(path).c_str(), "wb");
+#endif
+	if (!f)
+		return false;
+	bool ok = fwrite(data.data(), data.size(), 1, f) == 1;
+	if (fclose(f))
+		ok = false;
+	return ok;
+}
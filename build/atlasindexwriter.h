@@ -0,0 +1,36 @@
+#pragma once
+
+#include "atlasindex.h"
+#include <string>
+#include <vector>
+
+//build the binary atlas index read by AtlasIndex
+class AtlasIndexWriter
+{
+public:
+	AtlasIndexWriter() {}
+
+	//file is the batch image without directory
+	void addPage(const std::string &file, uint32_t w, uint32_t h);
+	//names are utf8, the first one is the file of the sprite and the others are linked to it
+	void addSprite(const std::vector<std::string> &names, uint32_t rawWidth, uint32_t rawHeight, uint32_t page, bool rot90, const std::vector<AtlasIndex::Rect> &rects);
+
+	//build the hash and lay out the file, fail if a name is added twice
+	bool build(std::vector<unsigned char> &out) const;
+	bool save(const std::wstring &path) const;
+
+private:
+	AtlasIndex::String addString(const std::string &str);
+	//seed of every bucket and name index of every slot
+	bool buildHash(std::vector<uint32_t> &buckets, std::vector<uint32_t> &slots) const;
+
+	std::vector<AtlasIndex::Page> pages;
+	std::vector<AtlasIndex::Sprite> sprites;
+	std::vector<AtlasIndex::Rect> rects;
+	std::vector<AtlasIndex::Name> names;
+	std::string strings;
+
+	// noncopyable
+	AtlasIndexWriter(const AtlasIndexWriter&) = delete;
+	AtlasIndexWriter &operator = (const AtlasIndexWriter&) = delete;
+};
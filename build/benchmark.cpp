@@ -0,0 +1,433 @@
+//standalone benchmarks, not a part of ImagePacker
+//build on linux:
+//  g++ -std=c++14 -O2 -pthread -I../third_party/include benchmark.cpp packer.cpp pixelkernels.cpp tiledict.cpp pngencoder.cpp <bkutf8 source> -lz -o benchmark
+//usage:
+//  benchmark corpus dir [options]   write a synthetic sprite corpus, to run ImagePacker --profile on
+//  benchmark kernels|pack|png|tile|all [options]
+//options:
+//  -count n -minsize n -maxsize n -dist uniform|log -margin n -dup ratio -seed n -iters n -maxwidth n
+//every result is a line of json on stdout, so runs can be compared by scripts
+#include "packer.h"
+#include "pixelkernels.h"
+#include "tiledict.h"
+#include "pngencoder.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include "../Bagel/Engine/bkutf8.h"
+#undef min
+#undef max
+
+using namespace std;
+
+struct BenchOptions
+{
+	int count;
+	int minsize;
+	int maxsize;
+	bool logdist;
+	//max transparent pixels around a sprite
+	int margin;
+	//ratio of sprites which are copies of an earlier one
+	double dup;
+	unsigned int seed;
+	int iters;
+	int maxwidth;
+};
+
+static BenchOptions bo = { 500, 8, 256, false, 8, 0.1, 1, 10, 4096 };
+
+static double now()
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Sprite
+{
+	int w, h;
+	vector<uint32_t> pixels;
+	//index of the sprite copied, -1 for an original one
+	int dupOf;
+};
+
+static int randomSize(mt19937 &rng)
+{
+	if (bo.logdist)
+	{
+		uniform_real_distribution<double> d(log((double)bo.minsize), log((double)bo.maxsize));
+		return (int)exp(d(rng));
+	}
+	uniform_int_distribution<int> d(bo.minsize, bo.maxsize);
+	return d(rng);
+}
+
+//opaque area looks like drawn art: smooth gradient with some blocks, surrounded by transparent margins
+static void generateSprites(vector<Sprite> &sprites)
+{
+	mt19937 rng(bo.seed);
+	uniform_real_distribution<double> unit(0, 1);
+	sprites.resize(bo.count);
+	for (int i = 0; i < bo.count; i++)
+	{
+		Sprite &s = sprites[i];
+		if (i > 0 && unit(rng) < bo.dup)
+		{
+			s.dupOf = uniform_int_distribution<int>(0, i - 1)(rng);
+			while (sprites[s.dupOf].dupOf >= 0)
+				s.dupOf = sprites[s.dupOf].dupOf;
+			s.w = sprites[s.dupOf].w;
+			s.h = sprites[s.dupOf].h;
+			s.pixels = sprites[s.dupOf].pixels;
+			continue;
+		}
+		s.dupOf = -1;
+		s.w = randomSize(rng);
+		s.h = randomSize(rng);
+		s.pixels.assign((size_t)s.w * s.h, 0);
+		uniform_int_distribution<int> m(0, bo.margin);
+		int left = min(m(rng), s.w / 2 - 1);
+		int right = min(m(rng), s.w / 2 - 1);
+		int top = min(m(rng), s.h / 2 - 1);
+		int bottom = min(m(rng), s.h / 2 - 1);
+		uint32_t base = rng();
+		int block = 4 + rng() % 12;
+		for (int y = max(top, 0); y < s.h - max(bottom, 0); y++)
+		{
+			for (int x = max(left, 0); x < s.w - max(right, 0); x++)
+			{
+				uint32_t r = (base & 0xFF) + x * 2;
+				uint32_t g = ((base >> 8) & 0xFF) + y * 2;
+				uint32_t b = ((base >> 16) & 0xFF) + ((x / block + y / block) & 1) * 64;
+				s.pixels[y * s.w + x] = (r & 0xFF) | (g & 0xFF) << 8 | (b & 0xFF) << 16 | 0xFF000000;
+			}
+		}
+	}
+}
+
+static bool savePNG(const string &file, const unsigned char *pixels, int w, int h, int level, PNGEncoder::Filter filter)
+{
+	PNGEncoder encoder(level, filter);
+	if (!encoder.begin(UniFromUTF8(file), w, h, 4))
+		return false;
+	encoder.writeRows(pixels, h);
+	return encoder.end();
+}
+
+static int benchCorpus(const string &dir)
+{
+	vector<Sprite> sprites;
+	generateSprites(sprites);
+	int64_t area = 0;
+	int dups = 0;
+	double t = now();
+	for (int i = 0; i < (int)sprites.size(); i++)
+	{
+		char name[32];
+		sprintf(name, "/sprite%05d.png", i);
+		if (!savePNG(dir + name, (const unsigned char *)sprites[i].pixels.data(), sprites[i].w, sprites[i].h, 6, PNGEncoder::FILTER_ADAPTIVE))
+		{
+			fprintf(stderr, "fail to write %s%s\n", dir.c_str(), name);
+			return 1;
+		}
+		area += (int64_t)sprites[i].w * sprites[i].h;
+		if (sprites[i].dupOf >= 0)
+			dups++;
+	}
+	printf("{\"bench\": \"corpus\", \"count\": %d, \"duplicates\": %d, \"pixels\": %lld, \"seconds\": %.3f}\n", bo.count, dups, (long long)area, now() - t);
+	return 0;
+}
+
+static void reportKernel(const char *name, KernelLevel level, double bytes, double seconds)
+{
+	printf("{\"bench\": \"kernel\", \"name\": \"%s\", \"level\": \"%s\", \"MBps\": %.1f}\n", name, getKernelLevelName(level), bytes / seconds / 1e6);
+}
+
+static int benchKernels()
+{
+	const int w = 2048, h = 2048;
+	vector<uint32_t> src((size_t)w * h), dst((size_t)w * h);
+	mt19937 rng(bo.seed);
+	for (int y = 0; y < h; y++)
+	{
+		//transparent margins like a sprite before trimming
+		int l = rng() % (w / 4), r = w - rng() % (w / 4);
+		for (int x = l; x < r; x++)
+			src[(size_t)y * w + x] = rng() | 0xFF000000;
+	}
+	KernelLevel saved = getKernelLevel();
+	for (int l = KERNEL_SCALAR; l <= getCpuKernelLevel(); l++)
+	{
+		KernelLevel level = (KernelLevel)l;
+		setKernelLevel(level);
+		double t = now();
+		int64_t sum = 0;
+		for (int i = 0; i < bo.iters; i++)
+		{
+			for (int y = 0; y < h; y++)
+			{
+				int first, last;
+				if (findAlphaRange((const unsigned char *)&src[(size_t)y * w], w, first, last))
+					sum += last - first;
+			}
+		}
+		reportKernel("findAlphaRange", level, 4.0 * w * h * bo.iters, now() - t);
+		t = now();
+		for (int i = 0; i < bo.iters; i++)
+			rotate90(src.data(), w, w, h, dst.data(), h);
+		reportKernel("rotate90", level, 4.0 * w * h * bo.iters, now() - t);
+		t = now();
+		for (int i = 0; i < bo.iters; i++)
+			convertRGBAToRGB((const unsigned char *)src.data(), (unsigned char *)dst.data(), w * h);
+		reportKernel("convertRGBAToRGB", level, 4.0 * w * h * bo.iters, now() - t);
+		//keep the loops from being optimized away
+		if (sum == -1)
+			printf("%u\n", dst[0]);
+	}
+	setKernelLevel(saved);
+	return 0;
+}
+
+static bool packAllOn(Packer::Method method, const vector<PackItem> &items, int w, int h)
+{
+	vector<PackItem> res = items;
+	return Packer::create(method)->pack(w, h, 2, res);
+}
+
+//the smallest canvas that holds everything: power of two widths around the square one, the height bisected to 8 pixels
+//the fill there tells how tight a packer is, one fixed canvas only tells if it's big enough
+static bool findTightCanvas(Packer::Method method, const vector<PackItem> &items, int64_t area, int &w, int &h)
+{
+	int maxW = 1, maxH = 1;
+	for (auto &it : items)
+	{
+		maxW = max(maxW, it.w);
+		maxH = max(maxH, it.h);
+	}
+	int side = 1;
+	while ((int64_t)side * side < area)
+		side <<= 1;
+	bool found = false;
+	for (int sw = max(side / 2, 1); sw <= min(side * 2, bo.maxwidth); sw *= 2)
+	{
+		if (sw < maxW || !packAllOn(method, items, sw, bo.maxwidth))
+			continue;
+		//lo doesn't hold everything, hi does
+		int lo = (int)max<int64_t>(maxH, area / sw) - 1, hi = bo.maxwidth;
+		while (hi - lo > 8)
+		{
+			int mid = lo + (hi - lo) / 2;
+			if (packAllOn(method, items, sw, mid))
+				hi = mid;
+			else
+				lo = mid;
+		}
+		if (!found || (int64_t)sw * hi < (int64_t)w * h)
+		{
+			w = sw;
+			h = hi;
+			found = true;
+		}
+	}
+	return found;
+}
+
+static int benchPack()
+{
+	vector<Sprite> sprites;
+	generateSprites(sprites);
+	vector<PackItem> items;
+	int64_t area = 0;
+	for (auto &it : sprites)
+	{
+		if (it.dupOf >= 0)
+			continue;
+		items.push_back({ it.w, it.h, nullptr, false, { 0,0,0,0 } });
+		area += (int64_t)it.w * it.h;
+	}
+	for (int m = 0; m < Packer::METHOD_COUNT; m++)
+	{
+		Packer::Method method = (Packer::Method)m;
+		//contact point scoring is quadratic in image count
+		if (method == Packer::MAXRECTS_CP && items.size() > 1000)
+			continue;
+		//if nothing holds all, how many fit on the largest page
+		int w = bo.maxwidth, h = bo.maxwidth;
+		bool all = findTightCanvas(method, items, area, w, h);
+		vector<PackItem> res;
+		double t = now();
+		for (int i = 0; i < bo.iters; i++)
+		{
+			res = items;
+			Packer::create(method)->pack(w, h, 2, res);
+		}
+		double seconds = (now() - t) / bo.iters;
+		int placed = 0;
+		int64_t placedArea = 0;
+		for (auto &it : res)
+		{
+			if (it.placed)
+			{
+				placed++;
+				placedArea += (int64_t)it.w * it.h;
+			}
+		}
+		printf("{\"bench\": \"pack\", \"method\": \"%s\", \"items\": %d, \"all\": %s, \"canvas\": [%d, %d], \"placed\": %d, \"fill\": %.4f, \"ms\": %.3f}\n",
+			Packer::methodName(method), (int)items.size(), all ? "true" : "false", w, h, placed, (double)placedArea / ((double)w * h), seconds * 1000);
+	}
+	return 0;
+}
+
+static int benchPNG()
+{
+	//an atlas-like image: sprites drawn side by side
+	vector<Sprite> sprites;
+	generateSprites(sprites);
+	const int w = 2048, h = 2048;
+	vector<uint32_t> atlas((size_t)w * h, 0);
+	int x = 0, y = 0, rowh = 0;
+	for (auto &s : sprites)
+	{
+		if (x + s.w > w)
+		{
+			x = 0;
+			y += rowh;
+			rowh = 0;
+		}
+		if (y + s.h > h)
+			break;
+		for (int j = 0; j < s.h; j++)
+			memcpy(&atlas[(size_t)(y + j) * w + x], &s.pixels[(size_t)j * s.w], s.w * 4);
+		x += s.w;
+		rowh = max(rowh, s.h);
+	}
+	const char *file = "benchmark_tmp.png";
+	static const int levels[] = { 1, 6, 9 };
+	static const PNGEncoder::Filter filters[] = { PNGEncoder::FILTER_NONE, PNGEncoder::FILTER_UP, PNGEncoder::FILTER_ADAPTIVE };
+	static const char *filterNames[] = { "none", "up", "adaptive" };
+	for (int level : levels)
+	{
+		for (int f = 0; f < 3; f++)
+		{
+			double t = now();
+			for (int i = 0; i < bo.iters; i++)
+				savePNG(file, (const unsigned char *)atlas.data(), w, h, level, filters[f]);
+			double seconds = (now() - t) / bo.iters;
+			FILE *fp = fopen(file, "rb");
+			long size = 0;
+			if (fp)
+			{
+				fseek(fp, 0, SEEK_END);
+				size = ftell(fp);
+				fclose(fp);
+			}
+			printf("{\"bench\": \"png\", \"level\": %d, \"filter\": \"%s\", \"bytes\": %ld, \"MBps\": %.1f}\n", level, filterNames[f], size, 4.0 * w * h / seconds / 1e6);
+		}
+	}
+	remove(file);
+	return 0;
+}
+
+static int benchTile()
+{
+	const int w = 2048, h = 2048, tile = 32;
+	vector<uint32_t> src((size_t)w * h);
+	mt19937 rng(bo.seed);
+	//a few distinct tiles repeated, like frames sharing parts
+	for (int ty = 0; ty < h; ty += tile)
+	{
+		for (int tx = 0; tx < w; tx += tile)
+		{
+			uint32_t v = rng() % 64;
+			for (int y = ty; y < ty + tile; y++)
+				for (int x = tx; x < tx + tile; x++)
+					src[(size_t)y * w + x] = v * 0x01010101u;
+		}
+	}
+	double t = now();
+	size_t unique = 0;
+	for (int i = 0; i < bo.iters; i++)
+	{
+		TileDict dict;
+		for (int ty = 0; ty < h; ty += tile)
+		{
+			for (int tx = 0; tx < w; tx += tile)
+			{
+				const unsigned char *p = (const unsigned char *)&src[(size_t)ty * w + tx];
+				dict.add(p, w * 4, tile, tile, TileDict::hashTile(p, w * 4, tile, tile));
+			}
+		}
+		unique = dict.size();
+	}
+	double seconds = (now() - t) / bo.iters;
+	printf("{\"bench\": \"tile\", \"tiles\": %d, \"unique\": %d, \"MBps\": %.1f}\n", (w / tile) * (h / tile), (int)unique, 4.0 * w * h / seconds / 1e6);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		printf("usage: %s corpus dir|kernels|pack|png|tile|all [-count n] [-minsize n] [-maxsize n] [-dist uniform|log] [-margin n] [-dup ratio] [-seed n] [-iters n] [-maxwidth n]\n", argv[0]);
+		return 1;
+	}
+	string cmd = argv[1];
+	string dir;
+	int i = 2;
+	if (cmd == "corpus")
+	{
+		if (argc < 3)
+		{
+			printf("corpus needs a directory\n");
+			return 1;
+		}
+		dir = argv[2];
+		i = 3;
+	}
+	for (; i + 1 < argc; i += 2)
+	{
+		string key = argv[i];
+		const char *value = argv[i + 1];
+		if (key == "-count")
+			bo.count = atoi(value);
+		else if (key == "-minsize")
+			bo.minsize = max(2, atoi(value));
+		else if (key == "-maxsize")
+			bo.maxsize = atoi(value);
+		else if (key == "-dist")
+			bo.logdist = !strcmp(value, "log");
+		else if (key == "-margin")
+			bo.margin = atoi(value);
+		else if (key == "-dup")
+			bo.dup = atof(value);
+		else if (key == "-seed")
+			bo.seed = (unsigned int)atoi(value);
+		else if (key == "-iters")
+			bo.iters = max(1, atoi(value));
+		else if (key == "-maxwidth")
+			bo.maxwidth = atoi(value);
+		else
+			printf("invalid param:%s\n", key.c_str());
+	}
+	bo.maxsize = max(bo.maxsize, bo.minsize);
+
+	if (cmd == "corpus")
+		return benchCorpus(dir);
+	if (cmd == "kernels")
+		return benchKernels();
+	if (cmd == "pack")
+		return benchPack();
+	if (cmd == "png")
+		return benchPNG();
+	if (cmd == "tile")
+		return benchTile();
+	if (cmd == "all")
+		return benchKernels() | benchPack() | benchPNG() | benchTile();
+	printf("unknown benchmark:%s\n", cmd.c_str());
+	return 1;
+}
@@ -1,8 +1,11 @@
 #include "image.h"
+#include "pixelkernels.h"
+#include "profiler.h"
 #include <string>
 #include <ctype.h>
 #include <stdio.h>
 #include <memory>
+#include <algorithm>
 #include "png.h"
 #include "jpeglib.h"
 #include "../Bagel/Engine/bkutf8.h"
@@ -109,6 +112,8 @@ bool Image::initWithImageData(unsigned char * pData,
             }
         }
     } while (0);
+    if (bRet)
+        Profiler::count(Profiler::COUNTER_DECODED_PIXELS, (int64_t)w * h);
     return bRet;
 }
 
@@ -181,6 +186,7 @@ my_error_exit (j_common_ptr cinfo)
 
 bool Image::_initWithJpgData(void * data, int nSize)
 {
+	ProfileScope scope(Profiler::PHASE_DECODE_JPEG);
     /* these are standard libjpeg structures for reading(decompression) */
     struct jpeg_decompress_struct cinfo;
     /* We use our private extension JPEG error handler.
@@ -278,6 +284,7 @@ bool Image::_initWithJpgData(void * data, int nSize)
 
 bool Image::_initWithPngData(void * pData, int nDatalen)
 {
+	ProfileScope scope(Profiler::PHASE_DECODE_PNG);
 // length of bytes to check if it is a valid png file
 #define PNGSIGSIZE  8
     bool bRet = false;
@@ -395,141 +402,29 @@ bool Image::_initWithPngData(void * pData, int nDatalen)
 }
 
 
-static void bke_write_png_callback(png_structp png_ptr, png_bytep data, png_size_t length)
+bool Image::saveImageToPNG(const wstring &pszFilePath, bool bIsToRGB, int nLevel, int nFilter)
 {
-	FILE *f=(FILE *)png_get_io_ptr(png_ptr);
-	fwrite(data, 1, length, f);
+	PNGEncoder encoder(nLevel, (PNGEncoder::Filter)nFilter);
+	if (!bIsToRGB)
+	{
+		if (!encoder.begin(pszFilePath, w, h, 4))
+			return false;
+		encoder.writeRows(pixels, h);
+		return encoder.end();
+	}
+
+	if (!encoder.begin(pszFilePath, w, h, 3))
+		return false;
+	//convert by blocks of rows, so the whole RGB copy isn't needed
+	unsigned int rows = h;
+	if (w)
+		rows = max(1u, min(h, (unsigned int)(4 * 1024 * 1024 / (w * 3))));
+	unique_ptr<unsigned char[]> pTempData(new unsigned char[(size_t)w * rows * 3]);
+	for (unsigned int y = 0; y < h; y += rows)
+	{
+		unsigned int n = min(rows, h - y);
+		convertRGBAToRGB(pixels + (size_t)y * pitch, pTempData.get(), w * n);
+		encoder.writeRows(pTempData.get(), n);
+	}
+	return encoder.end();
 }
-
-bool Image::saveImageToPNG(const wstring &pszFilePath, bool bIsToRGB)
-{
-    bool bRet = false;
-    do 
-    {
-		wstring filename;
-		size_t offset=pszFilePath.rfind('.');
-		filename=pszFilePath.substr(0,offset) + L".png";
-        FILE *f = NULL;
-        png_structp png_ptr;
-        png_infop info_ptr;
-        png_colorp palette;
-        png_bytep *row_pointers;
-
-#ifdef _WIN32
-		f = _wfopen(pszFilePath.c_str(), L"wb");
-#else
-		f = fopen(UniToUTF8(pszFilePath).c_str(), "wb");
-#endif
-		if (f == NULL)
-			break;
-
-        png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-
-        if (NULL == png_ptr)
-        {
-            fclose(f);
-            break;
-        }
-
-        info_ptr = png_create_info_struct(png_ptr);
-        if (info_ptr == NULL)
-        {
-			fclose(f);
-            png_destroy_write_struct(&png_ptr, NULL);
-            break;
-        }
-#if (CC_TARGET_PLATFORM != CC_PLATFORM_BADA && CC_TARGET_PLATFORM != CC_PLATFORM_NACL)
-        if (setjmp(png_jmpbuf(png_ptr)))
-        {
-            fclose(fp);
-            png_destroy_write_struct(&png_ptr, &info_ptr);
-            break;
-        }
-#endif
-        png_set_write_fn(png_ptr ,f ,bke_write_png_callback ,NULL);
-
-        if (!bIsToRGB)
-        {
-            png_set_IHDR(png_ptr, info_ptr, w, h, 8, PNG_COLOR_TYPE_RGB_ALPHA,
-                PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-        } 
-        else
-        {
-            png_set_IHDR(png_ptr, info_ptr, w, h, 8, PNG_COLOR_TYPE_RGB,
-                PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-        }
-
-        palette = (png_colorp)png_malloc(png_ptr, PNG_MAX_PALETTE_LENGTH * sizeof (png_color));
-        png_set_PLTE(png_ptr, info_ptr, palette, PNG_MAX_PALETTE_LENGTH);
-
-        png_write_info(png_ptr, info_ptr);
-
-        png_set_packing(png_ptr);
-
-        row_pointers = (png_bytep *)malloc(h * sizeof(png_bytep));
-        if(row_pointers == NULL)
-        {
-			fclose(f);
-            png_destroy_write_struct(&png_ptr, &info_ptr);
-            break;
-        }
-
-		if (bIsToRGB)
-		{
-			unsigned char *pTempData = new unsigned char[w * h * 3];
-			if (pTempData == NULL)
-			{
-				fclose(f);
-				png_destroy_write_struct(&png_ptr, &info_ptr);
-				break;
-			}
-
-			for (unsigned int i = 0; i < h; ++i)
-			{
-				for (unsigned int j = 0; j < w; ++j)
-				{
-					pTempData[(i * w + j) * 3] = pixels[(i * w + j) * 4];
-					pTempData[(i * w + j) * 3 + 1] = pixels[(i * w + j) * 4 + 1];
-					pTempData[(i * w + j) * 3 + 2] = pixels[(i * w + j) * 4 + 2];
-				}
-			}
-
-			for (int i = 0; i < (int)h; i++)
-			{
-				row_pointers[i] = (png_bytep)pTempData + i * w * 3;
-			}
-
-			png_write_image(png_ptr, row_pointers);
-
-			free(row_pointers);
-			row_pointers = NULL;
-
-			if (pTempData)
-				delete[] pTempData;
-		}
-		else
-		{
-			for (int i = 0; i < (int)h; i++)
-			{
-				row_pointers[i] = (png_bytep)pixels + i * w * 4;
-			}
-
-			png_write_image(png_ptr, row_pointers);
-
-			free(row_pointers);
-			row_pointers = NULL;
-		}
-
-        png_write_end(png_ptr, info_ptr);
-
-        png_free(png_ptr, palette);
-        palette = NULL;
-
-        png_destroy_write_struct(&png_ptr, &info_ptr);
-
-		fclose(f);
-
-        bRet = true;
-    } while (0);
-    return bRet;
-}
\ No newline at end of file
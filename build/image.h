@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include "pngencoder.h"
 
 class Image
 {
@@ -19,7 +20,7 @@ public:
 		int nHeight = 0);
 	void clear();
 
-	bool saveImageToPNG(const std::wstring & pszFilePath, bool bIsToRGB);
+	bool saveImageToPNG(const std::wstring & pszFilePath, bool bIsToRGB, int nLevel = 6, int nFilter = PNGEncoder::FILTER_ADAPTIVE);
 
 	unsigned int w, h, pitch;
 	unsigned char *pixels;
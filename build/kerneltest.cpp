@@ -0,0 +1,131 @@
+//standalone test of the pixel kernels, not a part of ImagePacker
+//build on linux:
+//  g++ -std=c++14 -O2 -fsanitize=address kerneltest.cpp pixelkernels.cpp -o kerneltest
+//every level the cpu supports is compared with the scalar result, exit code is the count of failures
+#include "pixelkernels.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <random>
+
+using namespace std;
+
+static int failures = 0;
+static int checks = 0;
+
+static void check(bool ok, const char *kernel, KernelLevel level, const char *what, int a, int b)
+{
+	checks++;
+	if (ok)
+		return;
+	failures++;
+	if (failures <= 20)
+		printf("FAIL %s %s: %s (%d, %d)\n", kernel, getKernelLevelName(level), what, a, b);
+}
+
+//random pixels, rows are fully transparent, partly transparent or opaque
+static void randomPixels(mt19937 &rng, vector<uint32_t> &pixels, int w, int h)
+{
+	for (int y = 0; y < h; y++)
+	{
+		int kind = rng() % 4;
+		int l = w ? rng() % w : 0;
+		int r = w ? l + rng() % (w - l) : 0;
+		for (int x = 0; x < w; x++)
+		{
+			uint32_t c = rng() & 0x00FFFFFF;
+			if (kind == 1 || (kind == 2 && x >= l && x <= r))
+				c |= (uint32_t)(rng() % 255 + 1) << 24;
+			//single visible pixels at the ends
+			if (kind == 3 && (x == l || x == r))
+				c |= 0x01000000;
+			pixels[(size_t)y * w + x] = c;
+		}
+	}
+}
+
+static void testFindAlphaRange(mt19937 &rng, KernelLevel level)
+{
+	for (int w = 1; w <= 300; w++)
+	{
+		vector<uint32_t> row(w);
+		for (int n = 0; n < 8; n++)
+		{
+			randomPixels(rng, row, w, 1);
+			//a few visible pixels around the ends of vectors
+			if (n == 7)
+			{
+				for (auto &c : row)
+					c &= 0x00FFFFFF;
+				row[rng() % w] |= 0xFF000000;
+			}
+			int first0 = -1, last0 = -1, first1 = -1, last1 = -1;
+			setKernelLevel(KERNEL_SCALAR);
+			bool res0 = findAlphaRange((const unsigned char *)row.data(), w, first0, last0);
+			setKernelLevel(level);
+			bool res1 = findAlphaRange((const unsigned char *)row.data(), w, first1, last1);
+			check(res0 == res1, "findAlphaRange", level, "result", w, n);
+			if (res0 && res1)
+			{
+				check(first0 == first1, "findAlphaRange", level, "first", first0, first1);
+				check(last0 == last1, "findAlphaRange", level, "last", last0, last1);
+			}
+		}
+	}
+}
+
+static void testRotate90(mt19937 &rng, KernelLevel level)
+{
+	for (int n = 0; n < 400; n++)
+	{
+		int w = n < 100 ? n % 20 + 1 : rng() % 200 + 1;
+		int h = n < 100 ? n / 20 + 1 : rng() % 200 + 1;
+		//pitches wider than the block, the rest of dst must be kept
+		int srcPitch = w + rng() % 5;
+		int dstPitch = h + rng() % 5;
+		vector<uint32_t> src((size_t)srcPitch * h);
+		randomPixels(rng, src, srcPitch, h);
+		vector<uint32_t> dst0((size_t)dstPitch * w, 0xDEADBEEF), dst1((size_t)dstPitch * w, 0xDEADBEEF);
+		setKernelLevel(KERNEL_SCALAR);
+		rotate90(src.data(), srcPitch, w, h, dst0.data(), dstPitch);
+		setKernelLevel(level);
+		rotate90(src.data(), srcPitch, w, h, dst1.data(), dstPitch);
+		check(dst0 == dst1, "rotate90", level, "pixels", w, h);
+	}
+}
+
+static void testConvertRGBAToRGB(mt19937 &rng, KernelLevel level)
+{
+	//every count around the ends of the vector loops, then random ones
+	const int guard = 32;
+	for (int n = 0; n < 300; n++)
+	{
+		int count = n < 200 ? n : rng() % 5000;
+		vector<uint32_t> src(count);
+		randomPixels(rng, src, count, 1);
+		vector<unsigned char> dst0(count * 3 + guard, 0xA5), dst1(count * 3 + guard, 0xA5);
+		setKernelLevel(KERNEL_SCALAR);
+		convertRGBAToRGB((const unsigned char *)src.data(), dst0.data(), count);
+		setKernelLevel(level);
+		convertRGBAToRGB((const unsigned char *)src.data(), dst1.data(), count);
+		check(dst0 == dst1, "convertRGBAToRGB", level, "pixels or bytes after dst", count, 0);
+	}
+}
+
+int main()
+{
+	mt19937 rng(1);
+	KernelLevel saved = getKernelLevel();
+	for (int l = KERNEL_SCALAR; l <= getCpuKernelLevel(); l++)
+	{
+		KernelLevel level = (KernelLevel)l;
+		int before = failures;
+		testFindAlphaRange(rng, level);
+		testRotate90(rng, level);
+		testConvertRGBAToRGB(rng, level);
+		printf("%s: %s\n", getKernelLevelName(level), failures == before ? "ok" : "FAILED");
+	}
+	setKernelLevel(saved);
+	printf("%d checks, %d failures\n", checks, failures);
+	return failures;
+}
@@ -0,0 +1,248 @@
+#include "packcache.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "../Bagel/Engine/bkutf8.h"
+#ifdef _WIN32
+#define _WINSOCKAPI_
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+static const char cacheMagic[4] = { 'I', 'P', 'K', 'C' };
+static const uint32_t cacheVersion = 3;
+
+PackCache::PackCache()
+: base(nullptr)
+, size(0)
+, handle(nullptr)
+, mapping(nullptr)
+, layoutValid(false)
+{
+}
+
+PackCache::~PackCache()
+{
+	close();
+}
+
+bool PackCache::open(const wstring &file, uint32_t flags)
+{
+	close();
+#ifdef _WIN32
+	HANDLE h = CreateFileW(file.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h == INVALID_HANDLE_VALUE)
+		return false;
+	handle = h;
+	LARGE_INTEGER s;
+	if (!GetFileSizeEx(h, &s) || s.QuadPart == 0)
+	{
+		close();
+		return false;
+	}
+	size = s.QuadPart;
+	mapping = CreateFileMappingW(h, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping)
+	{
+		close();
+		return false;
+	}
+	base = (const unsigned char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+	int fd = ::open(UniToUTF8(file).c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size == 0)
+	{
+		::close(fd);
+		return false;
+	}
+	size = st.st_size;
+	void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	base = p == MAP_FAILED ? nullptr : (const unsigned char *)p;
+#endif
+	if (!base)
+	{
+		close();
+		return false;
+	}
+
+	//validate everything once, so entries can be used without checking later
+	auto header = (const Header *)base;
+	if (size < sizeof(Header) || memcmp(header->magic, cacheMagic, 4) || header->version != cacheVersion || header->flags != flags
+		|| header->entriesOffset > size || (size - header->entriesOffset) / sizeof(Entry) < header->count)
+	{
+		close();
+		return false;
+	}
+	auto entries = (const Entry *)(base + header->entriesOffset);
+	for (uint32_t i = 0; i < header->count; i++)
+	{
+		auto &e = entries[i];
+		if (e.pathOffset > size || size - e.pathOffset < e.pathLength)
+		{
+			close();
+			return false;
+		}
+		if (e.hasPixels)
+		{
+			uint64_t len = (uint64_t)e.bounding[2] * e.bounding[3] * 4;
+			if (e.bounding[2] <= 0 || e.bounding[3] <= 0 || e.pixelOffset > size || size - e.pixelOffset < len)
+			{
+				close();
+				return false;
+			}
+		}
+		index[UniFromUTF8(string((const char *)base + e.pathOffset, (size_t)e.pathLength))] = &e;
+	}
+	memcpy(layout, header->layout, sizeof(layout));
+	layoutValid = true;
+	return true;
+}
+
+void PackCache::close()
+{
+	index.clear();
+	layoutValid = false;
+#ifdef _WIN32
+	if (base)
+		UnmapViewOfFile(base);
+	if (mapping)
+		CloseHandle((HANDLE)mapping);
+	if (handle)
+		CloseHandle((HANDLE)handle);
+#else
+	if (base)
+		munmap((void *)base, size);
+#endif
+	base = nullptr;
+	mapping = nullptr;
+	handle = nullptr;
+	size = 0;
+}
+
+const PackCache::Entry *PackCache::find(const wstring &path, uint64_t fileSize, int64_t mtime) const
+{
+	auto it = index.find(path);
+	if (it == index.end())
+		return nullptr;
+	if (it->second->fileSize != fileSize || it->second->mtime != mtime)
+		return nullptr;
+	return it->second;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// PackCacheWriter
+//////////////////////////////////////////////////////////////////////////
+
+PackCacheWriter::PackCacheWriter()
+: f(nullptr)
+, offset(0)
+, failed(false)
+{
+}
+
+PackCacheWriter::~PackCacheWriter()
+{
+	close();
+}
+
+void PackCacheWriter::close()
+{
+	if (f)
+		fclose(f);
+	f = nullptr;
+}
+
+bool PackCacheWriter::open(const wstring &file)
+{
+#ifdef _WIN32
+	f = _wfopen(file.c_str(), L"wb");
+#else
+	f = fopen(UniToUTF8(file).c_str(), "wb");
+#endif
+	if (!f)
+		return false;
+	//header is written again in finish
+	PackCache::Header header;
+	memset(&header, 0, sizeof(header));
+	failed = fwrite(&header, sizeof(header), 1, f) != 1;
+	offset = sizeof(header);
+	return !failed;
+}
+
+uint64_t PackCacheWriter::writePixels(const unsigned char *pixels, uint64_t len)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	uint64_t res = offset;
+	if (!failed && len)
+		failed = fwrite(pixels, (size_t)len, 1, f) != 1;
+	offset += len;
+	return res;
+}
+
+bool PackCacheWriter::finish(uint32_t flags, const unsigned char *layout, const vector<pair<wstring, PackCache::Entry>> &entries)
+{
+	if (!f)
+		return false;
+	//keep entries aligned
+	static const char zeros[8] = { 0 };
+	size_t pad = (8 - offset % 8) % 8;
+	if (!failed && pad)
+		failed = fwrite(zeros, pad, 1, f) != 1;
+	offset += pad;
+
+	PackCache::Header header;
+	memcpy(header.magic, cacheMagic, 4);
+	header.version = cacheVersion;
+	header.flags = flags;
+	header.count = (uint32_t)entries.size();
+	header.entriesOffset = offset;
+	memcpy(header.layout, layout, sizeof(header.layout));
+
+	string paths;
+	vector<PackCache::Entry> out;
+	out.reserve(entries.size());
+	uint64_t pathbase = offset + entries.size() * sizeof(PackCache::Entry);
+	for (auto &it : entries)
+	{
+		string p = UniToUTF8(it.first);
+		out.push_back(it.second);
+		out.back().pathOffset = pathbase + paths.size();
+		out.back().pathLength = p.size();
+		paths += p;
+	}
+	if (!failed && !out.empty())
+		failed = fwrite(out.data(), sizeof(PackCache::Entry), out.size(), f) != out.size();
+	if (!failed && !paths.empty())
+		failed = fwrite(paths.data(), paths.size(), 1, f) != 1;
+	if (!failed)
+		failed = fseek(f, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, f) != 1;
+	fclose(f);
+	f = nullptr;
+	return !failed;
+}
+
+bool PackCache::getFileStat(const wstring &file, uint64_t &fileSize, int64_t &mtime)
+{
+#ifdef _WIN32
+	struct __stat64 st;
+	if (_wstat64(file.c_str(), &st))
+		return false;
+#else
+	struct stat st;
+	if (stat(UniToUTF8(file).c_str(), &st))
+		return false;
+#endif
+	fileSize = st.st_size;
+	mtime = st.st_mtime;
+	return true;
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <stdio.h>
+#include <stdint.h>
+
+//on-disk cache of trimmed images, saved next to the output file
+//file layout: Header | RGBA8888 pixels | Entry[count] | utf8 paths
+//pixels come first so they can be written while loading, see PackCacheWriter
+//the file is mapped when loading, so entries and pixels are used in place
+class PackCache
+{
+public:
+	enum
+	{
+		FLAG_BOUND = 1,
+		FLAG_ROT90 = 2,
+	};
+
+	struct Header
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t flags;
+		uint32_t count;
+		uint64_t entriesOffset;
+		//digest of the last packed layout, see calcLayoutDigest
+		unsigned char layout[32];
+	};
+
+	struct Entry
+	{
+		uint64_t fileSize;
+		int64_t mtime;
+		//offset from the beginning of file, bounding.w * bounding.h * 4 bytes
+		uint64_t pixelOffset;
+		uint64_t pathOffset;
+		uint64_t pathLength;
+		int32_t rawwidth, rawheight;
+		//same as ImageInfo, after rotation
+		int32_t bounding[4];
+		int32_t boundingoffset[2];
+		uint8_t rot90;
+		uint8_t hasSha;
+		//false if the image is ignored by size
+		uint8_t hasPixels;
+		uint8_t reserved;
+		unsigned char sha[32];
+	};
+
+	PackCache();
+	~PackCache();
+
+	//map an existing cache file, fail if it's broken or made with different flags
+	bool open(const std::wstring &file, uint32_t flags);
+	void close();
+
+	//return nullptr if not found or the file is modified
+	const Entry *find(const std::wstring &path, uint64_t fileSize, int64_t mtime) const;
+	const unsigned char *getPixels(const Entry *e) const
+	{
+		return base + e->pixelOffset;
+	}
+	const unsigned char *getPixels(uint64_t pixelOffset) const
+	{
+		return base + pixelOffset;
+	}
+	bool hasLayout() const
+	{
+		return layoutValid;
+	}
+	const unsigned char *getLayout() const
+	{
+		return layout;
+	}
+
+	static bool getFileStat(const std::wstring &file, uint64_t &fileSize, int64_t &mtime);
+
+private:
+	const unsigned char *base;
+	uint64_t size;
+	void *handle;
+	void *mapping;
+
+	bool layoutValid;
+	unsigned char layout[32];
+	std::unordered_map<std::wstring, const Entry *> index;
+
+	// noncopyable
+	PackCache(const PackCache&) = delete;
+	PackCache &operator = (const PackCache&) = delete;
+};
+
+class PackCacheWriter
+{
+public:
+	PackCacheWriter();
+	~PackCacheWriter();
+
+	bool open(const std::wstring &file);
+	bool isOpen() const
+	{
+		return f != nullptr;
+	}
+	//thread safe, return the offset of pixels in file
+	uint64_t writePixels(const unsigned char *pixels, uint64_t len);
+	//close the file without finishing it, for failed runs
+	void close();
+	//write entries and header, and close the file
+	bool finish(uint32_t flags, const unsigned char *layout, const std::vector<std::pair<std::wstring, PackCache::Entry>> &entries);
+
+private:
+	FILE *f;
+	uint64_t offset;
+	bool failed;
+	std::mutex mutex;
+
+	// noncopyable
+	PackCacheWriter(const PackCacheWriter&) = delete;
+	PackCacheWriter &operator = (const PackCacheWriter&) = delete;
+};
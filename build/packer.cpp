@@ -0,0 +1,447 @@
+#include "packer.h"
+#include <map>
+#include <algorithm>
+#include <limits.h>
+
+using namespace std;
+
+//////////////////////////////////////////////////////////////////////////
+// Shelf: the original packer, tall images on the left, others in rows
+//////////////////////////////////////////////////////////////////////////
+
+class ShelfPacker : public Packer
+{
+protected:
+	static int findLeft(map<int, int>& LT, int t)
+	{
+		auto it = LT.upper_bound(t);
+		if (it == LT.end())
+			return 0;
+		return it->second;
+	}
+
+	bool tryPack(int w, int h, vector<PackItem *> &items)
+	{
+		//find imgs with large h
+		vector<PackItem*> LHimgs;
+		//the rest
+		vector<PackItem*> NMimgs;
+		for (auto it : items)
+		{
+			if (it->h >= h / 2)
+				LHimgs.push_back(it);
+			else
+				NMimgs.push_back(it);
+		}
+		auto cmp = [](PackItem* a, PackItem* b)
+		{
+			return a->h < b->h || (a->h == b->h && a->w < b->w);
+		};
+		bool retryonce = false;
+	retry:
+		sort(LHimgs.begin(), LHimgs.end(), cmp);
+		sort(NMimgs.begin(), NMimgs.end(), cmp);
+		map<int, int> LT;
+		//put all LHimgs to left
+		int left = 0;
+		for (auto it = LHimgs.rbegin(); it != LHimgs.rend(); ++it)
+		{
+			if (left + (*it)->w > w)
+				return false;
+			(*it)->dst = { left, 0, (*it)->w, (*it)->h };
+			(*it)->placed = true;
+			LT[(*it)->h] = left + (*it)->w;
+			left += (*it)->w;
+		}
+		//then we fill rest part
+		int linetop = 0;
+		int lineheight = 0;
+		left = findLeft(LT, linetop);
+		for (auto it = NMimgs.begin(); it != NMimgs.end();)
+		{
+			if (left + (*it)->w <= w)
+			{
+				if (linetop + (*it)->h > h)
+				{
+					//retry
+					if (retryonce)
+						return false;
+					retryonce = true;
+					//set all these imgs as LHimgs
+					LHimgs.insert(LHimgs.end(), it, NMimgs.end());
+					NMimgs.erase(it, NMimgs.end());
+					for (auto it2 : items)
+						it2->placed = false;
+					goto retry;
+				}
+				(*it)->dst = { left, linetop, (*it)->w, (*it)->h };
+				(*it)->placed = true;
+				lineheight = max(lineheight, (*it)->h);
+				left += (*it)->w;
+				++it;
+			}
+			else if (lineheight > 0)
+			{
+				linetop += lineheight;
+				lineheight = 0;
+				left = findLeft(LT, linetop);
+			}
+			else
+			{
+				//rest width is not enough
+				auto it2 = LT.begin();
+				while (it2 != LT.end())
+				{
+					if (it2->second + (*it)->w <= w)
+						break;
+					++it2;
+				}
+				if (it2 == LT.end())
+					return false;
+				if (w < (*it)->w || it2->first + (*it)->h > h)
+					return false;
+				linetop = it2->first;
+				lineheight = 0;
+				left = findLeft(LT, linetop);
+			}
+		}
+		return true;
+	}
+
+	virtual void doPack(int w, int h, vector<PackItem *> &items) override
+	{
+		//shelf is all or nothing
+		if (!tryPack(w, h, items))
+		{
+			for (auto it : items)
+				it->placed = false;
+		}
+	}
+};
+
+//////////////////////////////////////////////////////////////////////////
+// MaxRects: keep all maximal free rectangles, choose one by heuristic
+//////////////////////////////////////////////////////////////////////////
+
+class MaxRectsPacker : public Packer
+{
+public:
+	MaxRectsPacker(bool contactPoint) : contactPoint(contactPoint) {}
+
+protected:
+	bool contactPoint;
+	int binw, binh;
+	vector<Rect> freeRects;
+	vector<Rect> usedRects;
+
+	static int commonInterval(int a1, int a2, int b1, int b2)
+	{
+		if (a2 < b1 || b2 < a1)
+			return 0;
+		return min(a2, b2) - max(a1, b1);
+	}
+
+	int contactScore(int x, int y, int w, int h) const
+	{
+		int score = 0;
+		if (x == 0 || x + w == binw)
+			score += h;
+		if (y == 0 || y + h == binh)
+			score += w;
+		for (auto &r : usedRects)
+		{
+			if (r.x == x + w || r.x + r.w == x)
+				score += commonInterval(r.y, r.y + r.h, y, y + h);
+			if (r.y == y + h || r.y + r.h == y)
+				score += commonInterval(r.x, r.x + r.w, x, x + w);
+		}
+		return score;
+	}
+
+	//lower is better for both scores
+	bool findPosition(int w, int h, Rect &res) const
+	{
+		int best1 = INT_MAX, best2 = INT_MAX;
+		bool found = false;
+		for (auto &f : freeRects)
+		{
+			if (f.w < w || f.h < h)
+				continue;
+			int s1, s2;
+			if (contactPoint)
+			{
+				s1 = -contactScore(f.x, f.y, w, h);
+				s2 = f.y;
+			}
+			else
+			{
+				int lw = f.w - w;
+				int lh = f.h - h;
+				s1 = min(lw, lh);
+				s2 = max(lw, lh);
+			}
+			if (s1 < best1 || (s1 == best1 && s2 < best2))
+			{
+				best1 = s1;
+				best2 = s2;
+				res = { f.x, f.y, w, h };
+				found = true;
+			}
+		}
+		return found;
+	}
+
+	static bool intersect(const Rect &a, const Rect &b)
+	{
+		return a.x < b.x + b.w && a.x + a.w > b.x && a.y < b.y + b.h && a.y + a.h > b.y;
+	}
+
+	static bool contains(const Rect &a, const Rect &b)
+	{
+		return b.x >= a.x && b.y >= a.y && b.x + b.w <= a.x + a.w && b.y + b.h <= a.y + a.h;
+	}
+
+	void placeRect(const Rect &used)
+	{
+		vector<Rect> newRects;
+		for (size_t i = 0; i < freeRects.size();)
+		{
+			Rect f = freeRects[i];
+			if (!intersect(f, used))
+			{
+				++i;
+				continue;
+			}
+			//split the free rect into at most 4 maximal parts around used
+			if (used.x > f.x)
+				newRects.push_back({ f.x, f.y, used.x - f.x, f.h });
+			if (used.x + used.w < f.x + f.w)
+				newRects.push_back({ used.x + used.w, f.y, f.x + f.w - used.x - used.w, f.h });
+			if (used.y > f.y)
+				newRects.push_back({ f.x, f.y, f.w, used.y - f.y });
+			if (used.y + used.h < f.y + f.h)
+				newRects.push_back({ f.x, used.y + used.h, f.w, f.y + f.h - used.y - used.h });
+			freeRects[i] = freeRects.back();
+			freeRects.pop_back();
+		}
+		freeRects.insert(freeRects.end(), newRects.begin(), newRects.end());
+		//drop rects contained by another one
+		for (size_t i = 0; i < freeRects.size(); i++)
+		{
+			for (size_t j = i + 1; j < freeRects.size(); j++)
+			{
+				if (contains(freeRects[j], freeRects[i]))
+				{
+					freeRects.erase(freeRects.begin() + i);
+					--i;
+					break;
+				}
+				if (contains(freeRects[i], freeRects[j]))
+				{
+					freeRects.erase(freeRects.begin() + j);
+					--j;
+				}
+			}
+		}
+		usedRects.push_back(used);
+	}
+
+	virtual void doPack(int w, int h, vector<PackItem *> &items) override
+	{
+		binw = w;
+		binh = h;
+		freeRects.assign(1, { 0, 0, w, h });
+		usedRects.clear();
+		sort(items.begin(), items.end(), [](PackItem* a, PackItem* b)
+		{
+			int ma = max(a->w, a->h), mb = max(b->w, b->h);
+			if (ma != mb)
+				return ma > mb;
+			return min(a->w, a->h) > min(b->w, b->h);
+		});
+		for (auto it : items)
+		{
+			Rect r;
+			if (!findPosition(it->w, it->h, r))
+				continue;
+			placeRect(r);
+			it->dst = r;
+			it->placed = true;
+		}
+	}
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Skyline: bottom-left placement on the top contour of used area
+//////////////////////////////////////////////////////////////////////////
+
+class SkylinePacker : public Packer
+{
+protected:
+	struct Node
+	{
+		int x, y, w;
+	};
+	int binw, binh;
+	vector<Node> skyline;
+
+	//return the y where the item rests if put at node i, or -1
+	int fitAt(size_t i, int w, int h) const
+	{
+		int x = skyline[i].x;
+		if (x + w > binw)
+			return -1;
+		int y = skyline[i].y;
+		int rest = w;
+		while (rest > 0)
+		{
+			y = max(y, skyline[i].y);
+			if (y + h > binh)
+				return -1;
+			rest -= skyline[i].w;
+			++i;
+		}
+		return y;
+	}
+
+	void addLevel(size_t i, const Rect &r)
+	{
+		skyline.insert(skyline.begin() + i, { r.x, r.y + r.h, r.w });
+		for (size_t j = i + 1; j < skyline.size();)
+		{
+			auto &prev = skyline[j - 1];
+			auto &cur = skyline[j];
+			if (cur.x >= prev.x + prev.w)
+				break;
+			int shrink = prev.x + prev.w - cur.x;
+			if (cur.w > shrink)
+			{
+				cur.x += shrink;
+				cur.w -= shrink;
+				break;
+			}
+			skyline.erase(skyline.begin() + j);
+		}
+		for (size_t j = 1; j < skyline.size();)
+		{
+			if (skyline[j - 1].y == skyline[j].y)
+			{
+				skyline[j - 1].w += skyline[j].w;
+				skyline.erase(skyline.begin() + j);
+			}
+			else
+			{
+				++j;
+			}
+		}
+	}
+
+	virtual void doPack(int w, int h, vector<PackItem *> &items) override
+	{
+		binw = w;
+		binh = h;
+		skyline.assign(1, { 0, 0, w });
+		sort(items.begin(), items.end(), [](PackItem* a, PackItem* b)
+		{
+			return a->h > b->h || (a->h == b->h && a->w > b->w);
+		});
+		for (auto it : items)
+		{
+			int bestTop = INT_MAX, bestWidth = INT_MAX;
+			size_t bestIndex = 0;
+			Rect r;
+			for (size_t i = 0; i < skyline.size(); i++)
+			{
+				int y = fitAt(i, it->w, it->h);
+				if (y < 0)
+					continue;
+				if (y + it->h < bestTop || (y + it->h == bestTop && skyline[i].w < bestWidth))
+				{
+					bestTop = y + it->h;
+					bestWidth = skyline[i].w;
+					bestIndex = i;
+					r = { skyline[i].x, y, it->w, it->h };
+				}
+			}
+			if (bestTop == INT_MAX)
+				continue;
+			addLevel(bestIndex, r);
+			it->dst = r;
+			it->placed = true;
+		}
+	}
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Packer
+//////////////////////////////////////////////////////////////////////////
+
+unique_ptr<Packer> Packer::create(Method method)
+{
+	switch (method)
+	{
+	case SHELF:
+		return unique_ptr<Packer>(new ShelfPacker());
+	case MAXRECTS_BSSF:
+		return unique_ptr<Packer>(new MaxRectsPacker(false));
+	case MAXRECTS_CP:
+		return unique_ptr<Packer>(new MaxRectsPacker(true));
+	case SKYLINE:
+		return unique_ptr<Packer>(new SkylinePacker());
+	default:
+		return nullptr;
+	}
+}
+
+const char *Packer::methodName(Method method)
+{
+	switch (method)
+	{
+	case SHELF:
+		return "shelf";
+	case MAXRECTS_BSSF:
+		return "maxrects-bssf";
+	case MAXRECTS_CP:
+		return "maxrects-cp";
+	case SKYLINE:
+		return "skyline";
+	default:
+		return "unknown";
+	}
+}
+
+bool Packer::pack(int w, int h, int padding, vector<PackItem> &items, int align)
+{
+	//inflating every item and the canvas by padding gives gaps between items but not on the border
+	//all packers place items at edges of others, so sizes of multiples of align keep positions aligned
+	vector<PackItem *> ptrs;
+	vector<pair<int, int>> sizes;
+	ptrs.reserve(items.size());
+	sizes.reserve(items.size());
+	for (auto &it : items)
+	{
+		it.placed = false;
+		sizes.push_back({ it.w, it.h });
+		it.w = (it.w + padding + align - 1) / align * align;
+		it.h = (it.h + padding + align - 1) / align * align;
+		ptrs.push_back(&it);
+	}
+	doPack(w + padding, h + padding, ptrs);
+	bool all = true;
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		auto &it = items[i];
+		it.w = sizes[i].first;
+		it.h = sizes[i].second;
+		if (it.placed)
+		{
+			it.dst.w = it.w;
+			it.dst.h = it.h;
+		}
+		else
+		{
+			all = false;
+		}
+	}
+	return all;
+}
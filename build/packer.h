@@ -0,0 +1,53 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+
+typedef struct
+{
+	int x, y;
+} Point;
+typedef struct
+{
+	int x, y;
+	int w, h;
+} Rect;
+
+struct PackItem
+{
+	//size of the image, without padding
+	int w, h;
+	//owner of this item, packers never touch it
+	void *userdata;
+
+	bool placed;
+	Rect dst;
+};
+
+class Packer
+{
+public:
+	enum Method
+	{
+		SHELF,
+		MAXRECTS_BSSF,
+		MAXRECTS_CP,
+		SKYLINE,
+		METHOD_COUNT
+	};
+
+	static std::unique_ptr<Packer> create(Method method);
+	static const char *methodName(Method method);
+
+	virtual ~Packer() {}
+
+	//place as many items as possible into a w*h canvas, leave padding pixels between two items
+	//items never rotate here, rotation is decided when loading
+	//with align > 1, items start at multiples of align, for 4*4 blocks of texture formats
+	//return true if all items are placed
+	bool pack(int w, int h, int padding, std::vector<PackItem> &items, int align = 1);
+
+protected:
+	//items are already inflated by padding, and so is the canvas
+	virtual void doPack(int w, int h, std::vector<PackItem *> &items) = 0;
+};
@@ -0,0 +1,482 @@
+#include "pixelkernels.h"
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define KERNEL_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define KERNEL_TARGET(x)
+#else
+#include <cpuid.h>
+#define KERNEL_TARGET(x) __attribute__((target(x)))
+#endif
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+// dispatch
+//////////////////////////////////////////////////////////////////////////
+
+#ifdef KERNEL_X86
+static void cpuid(unsigned int info[4], unsigned int leaf, unsigned int sub)
+{
+#ifdef _MSC_VER
+	__cpuidex((int *)info, leaf, sub);
+#else
+	__cpuid_count(leaf, sub, info[0], info[1], info[2], info[3]);
+#endif
+}
+
+static uint64_t xgetbv0()
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	uint32_t a, d;
+	__asm__ volatile("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+	return ((uint64_t)d << 32) | a;
+#endif
+}
+#endif
+
+static KernelLevel detectCpuKernelLevel()
+{
+#ifdef KERNEL_X86
+	unsigned int info[4];
+	cpuid(info, 0, 0);
+	unsigned int maxleaf = info[0];
+	if (maxleaf < 1)
+		return KERNEL_SCALAR;
+	cpuid(info, 1, 0);
+	if (!(info[3] & (1 << 26)))
+		return KERNEL_SCALAR;
+	if (!(info[2] & (1 << 9)))
+		return KERNEL_SSE2;
+	//AVX needs the OS to save ymm registers
+	bool avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (xgetbv0() & 6) == 6;
+	if (avx && maxleaf >= 7)
+	{
+		cpuid(info, 7, 0);
+		if (info[1] & (1 << 5))
+			return KERNEL_AVX2;
+	}
+	return KERNEL_SSSE3;
+#else
+	return KERNEL_SCALAR;
+#endif
+}
+
+KernelLevel getCpuKernelLevel()
+{
+	static KernelLevel level = detectCpuKernelLevel();
+	return level;
+}
+
+static KernelLevel &currentLevel()
+{
+	static KernelLevel level = getCpuKernelLevel();
+	return level;
+}
+
+KernelLevel getKernelLevel()
+{
+	return currentLevel();
+}
+
+void setKernelLevel(KernelLevel level)
+{
+	if (level > getCpuKernelLevel())
+		level = getCpuKernelLevel();
+	currentLevel() = level;
+}
+
+const char *getKernelLevelName(KernelLevel level)
+{
+	switch (level)
+	{
+	case KERNEL_SSE2:
+		return "sse2";
+	case KERNEL_SSSE3:
+		return "ssse3";
+	case KERNEL_AVX2:
+		return "avx2";
+	default:
+		return "scalar";
+	}
+}
+
+static inline int lowestBit(int mask)
+{
+	int i = 0;
+	while (!(mask & 1))
+	{
+		mask >>= 1;
+		++i;
+	}
+	return i;
+}
+
+static inline int highestBit(int mask)
+{
+	int i = -1;
+	while (mask)
+	{
+		mask >>= 1;
+		++i;
+	}
+	return i;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// findAlphaRange
+//////////////////////////////////////////////////////////////////////////
+
+static bool findAlphaRangeScalar(const unsigned char *row, int width, int &first, int &last)
+{
+	int i = 0;
+	while (i < width && !row[i * 4 + 3])
+		++i;
+	if (i == width)
+		return false;
+	first = i;
+	i = width - 1;
+	while (!row[i * 4 + 3])
+		--i;
+	last = i;
+	return true;
+}
+
+#ifdef KERNEL_X86
+//one bit for each pixel with alpha > 0
+KERNEL_TARGET("sse2") static inline int alphaMask4(const unsigned char *p)
+{
+	__m128i a = _mm_srli_epi32(_mm_loadu_si128((const __m128i *)p), 24);
+	__m128i z = _mm_cmpeq_epi32(a, _mm_setzero_si128());
+	return ~_mm_movemask_ps(_mm_castsi128_ps(z)) & 0xF;
+}
+
+KERNEL_TARGET("avx2") static inline int alphaMask8(const unsigned char *p)
+{
+	__m256i a = _mm256_srli_epi32(_mm256_loadu_si256((const __m256i *)p), 24);
+	__m256i z = _mm256_cmpeq_epi32(a, _mm256_setzero_si256());
+	return ~_mm256_movemask_ps(_mm256_castsi256_ps(z)) & 0xFF;
+}
+
+//scan the rest of row by scalar code after simd loop
+static inline bool findFirstTail(const unsigned char *row, int i, int width, int &first)
+{
+	while (i < width && !row[i * 4 + 3])
+		++i;
+	if (i == width)
+		return false;
+	first = i;
+	return true;
+}
+
+static inline void findLastTail(const unsigned char *row, int j, int &last)
+{
+	--j;
+	while (!row[j * 4 + 3])
+		--j;
+	last = j;
+}
+
+KERNEL_TARGET("sse2") static bool findAlphaRangeSSE2(const unsigned char *row, int width, int &first, int &last)
+{
+	int i = 0;
+	int m = 0;
+	for (; i + 4 <= width; i += 4)
+	{
+		m = alphaMask4(row + i * 4);
+		if (m)
+			break;
+	}
+	if (m)
+		first = i + lowestBit(m);
+	else if (!findFirstTail(row, i, width, first))
+		return false;
+	//from right, first is the lower limit
+	int j = width;
+	for (; j - 4 >= first; j -= 4)
+	{
+		m = alphaMask4(row + (j - 4) * 4);
+		if (m)
+		{
+			last = j - 4 + highestBit(m);
+			return true;
+		}
+	}
+	findLastTail(row, j, last);
+	return true;
+}
+
+KERNEL_TARGET("avx2") static bool findAlphaRangeAVX2(const unsigned char *row, int width, int &first, int &last)
+{
+	int i = 0;
+	int m = 0;
+	for (; i + 8 <= width; i += 8)
+	{
+		m = alphaMask8(row + i * 4);
+		if (m)
+			break;
+	}
+	if (m)
+		first = i + lowestBit(m);
+	else if (!findFirstTail(row, i, width, first))
+		return false;
+	int j = width;
+	for (; j - 8 >= first; j -= 8)
+	{
+		m = alphaMask8(row + (j - 8) * 4);
+		if (m)
+		{
+			last = j - 8 + highestBit(m);
+			return true;
+		}
+	}
+	findLastTail(row, j, last);
+	return true;
+}
+#endif
+
+bool findAlphaRange(const unsigned char *row, int width, int &first, int &last)
+{
+	switch (getKernelLevel())
+	{
+#ifdef KERNEL_X86
+	case KERNEL_AVX2:
+		return findAlphaRangeAVX2(row, width, first, last);
+	case KERNEL_SSSE3:
+	case KERNEL_SSE2:
+		return findAlphaRangeSSE2(row, width, first, last);
+#endif
+	default:
+		return findAlphaRangeScalar(row, width, first, last);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// rotate90
+//////////////////////////////////////////////////////////////////////////
+
+//work on blocks so both src and dst lines stay in cache
+static const int rotateBlock = 32;
+
+static void rotate90Scalar(const uint32_t *src, int srcPitch, int w, int h, uint32_t *dst, int dstPitch)
+{
+	for (int by = 0; by < h; by += rotateBlock)
+	{
+		int ey = by + rotateBlock < h ? by + rotateBlock : h;
+		for (int bx = 0; bx < w; bx += rotateBlock)
+		{
+			int ex = bx + rotateBlock < w ? bx + rotateBlock : w;
+			for (int x = bx; x < ex; x++)
+			{
+				uint32_t *d = dst + (w - 1 - x) * dstPitch;
+				for (int y = by; y < ey; y++)
+					d[y] = src[y * srcPitch + x];
+			}
+		}
+	}
+}
+
+#ifdef KERNEL_X86
+//AVX2 has no cheap 8x8 transpose of 32 bit lanes, so all levels share the 4x4 one
+KERNEL_TARGET("sse2") static void rotate90SSE2(const uint32_t *src, int srcPitch, int w, int h, uint32_t *dst, int dstPitch)
+{
+	for (int by = 0; by < h; by += rotateBlock)
+	{
+		int ey = by + rotateBlock < h ? by + rotateBlock : h;
+		for (int bx = 0; bx < w; bx += rotateBlock)
+		{
+			int ex = bx + rotateBlock < w ? bx + rotateBlock : w;
+			int y = by;
+			for (; y + 4 <= ey; y += 4)
+			{
+				const uint32_t *s = src + y * srcPitch;
+				int x = bx;
+				for (; x + 4 <= ex; x += 4)
+				{
+					__m128i r0 = _mm_loadu_si128((const __m128i *)(s + x));
+					__m128i r1 = _mm_loadu_si128((const __m128i *)(s + srcPitch + x));
+					__m128i r2 = _mm_loadu_si128((const __m128i *)(s + srcPitch * 2 + x));
+					__m128i r3 = _mm_loadu_si128((const __m128i *)(s + srcPitch * 3 + x));
+					__m128i t0 = _mm_unpacklo_epi32(r0, r1);
+					__m128i t1 = _mm_unpacklo_epi32(r2, r3);
+					__m128i t2 = _mm_unpackhi_epi32(r0, r1);
+					__m128i t3 = _mm_unpackhi_epi32(r2, r3);
+					//column x + k goes to dst line w - 1 - x - k
+					uint32_t *d = dst + (w - 1 - x) * dstPitch + y;
+					_mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi64(t0, t1));
+					_mm_storeu_si128((__m128i *)(d - dstPitch), _mm_unpackhi_epi64(t0, t1));
+					_mm_storeu_si128((__m128i *)(d - dstPitch * 2), _mm_unpacklo_epi64(t2, t3));
+					_mm_storeu_si128((__m128i *)(d - dstPitch * 3), _mm_unpackhi_epi64(t2, t3));
+				}
+				for (; x < ex; x++)
+				{
+					uint32_t *d = dst + (w - 1 - x) * dstPitch + y;
+					d[0] = s[x];
+					d[1] = s[srcPitch + x];
+					d[2] = s[srcPitch * 2 + x];
+					d[3] = s[srcPitch * 3 + x];
+				}
+			}
+			for (; y < ey; y++)
+			{
+				for (int x = bx; x < ex; x++)
+					dst[(w - 1 - x) * dstPitch + y] = src[y * srcPitch + x];
+			}
+		}
+	}
+}
+#endif
+
+void rotate90(const uint32_t *src, int srcPitch, int w, int h, uint32_t *dst, int dstPitch)
+{
+#ifdef KERNEL_X86
+	if (getKernelLevel() >= KERNEL_SSE2)
+	{
+		rotate90SSE2(src, srcPitch, w, h, dst, dstPitch);
+		return;
+	}
+#endif
+	rotate90Scalar(src, srcPitch, w, h, dst, dstPitch);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// convertRGBAToRGB
+//////////////////////////////////////////////////////////////////////////
+
+static void convertRGBAToRGBScalar(const unsigned char *src, unsigned char *dst, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		dst[0] = src[0];
+		dst[1] = src[1];
+		dst[2] = src[2];
+		src += 4;
+		dst += 3;
+	}
+}
+
+#ifdef KERNEL_X86
+//16 bytes are stored for 12 bytes of output, so keep away from the end of dst
+KERNEL_TARGET("ssse3") static void convertRGBAToRGBSSSE3(const unsigned char *src, unsigned char *dst, int count)
+{
+	const __m128i shuf = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	int i = 0;
+	for (; i + 6 <= count; i += 4)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+		_mm_storeu_si128((__m128i *)(dst + i * 3), _mm_shuffle_epi8(v, shuf));
+	}
+	convertRGBAToRGBScalar(src + i * 4, dst + i * 3, count - i);
+}
+
+KERNEL_TARGET("avx2") static void convertRGBAToRGBAVX2(const unsigned char *src, unsigned char *dst, int count)
+{
+	const __m256i shuf = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	//join the 12 bytes of both lanes
+	const __m256i perm = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+	int i = 0;
+	for (; i + 11 <= count; i += 8)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+		v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, shuf), perm);
+		_mm256_storeu_si256((__m256i *)(dst + i * 3), v);
+	}
+	convertRGBAToRGBSSSE3(src + i * 4, dst + i * 3, count - i);
+}
+#endif
+
+void convertRGBAToRGB(const unsigned char *src, unsigned char *dst, int count)
+{
+	switch (getKernelLevel())
+	{
+#ifdef KERNEL_X86
+	case KERNEL_AVX2:
+		convertRGBAToRGBAVX2(src, dst, count);
+		break;
+	case KERNEL_SSSE3:
+		convertRGBAToRGBSSSE3(src, dst, count);
+		break;
+#endif
+	default:
+		convertRGBAToRGBScalar(src, dst, count);
+		break;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// premultiplyAlpha
+//////////////////////////////////////////////////////////////////////////
+
+void premultiplyAlpha(unsigned char *pixels, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		unsigned int a = pixels[3];
+		for (int k = 0; k < 3; k++)
+		{
+			//round(c * a / 255) without division
+			unsigned int v = pixels[k] * a + 128;
+			pixels[k] = (unsigned char)((v + (v >> 8)) >> 8);
+		}
+		pixels += 4;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// bleedAlpha
+//////////////////////////////////////////////////////////////////////////
+
+void bleedAlpha(unsigned char *pixels, int w, int h, int passes)
+{
+	//pixels which have a color, visible ones or filled in earlier passes
+	std::vector<unsigned char> colored((size_t)w * h);
+	for (size_t i = 0; i < colored.size(); i++)
+		colored[i] = pixels[i * 4 + 3] != 0;
+	std::vector<int> filled;
+	for (int pass = 0; pass < passes; pass++)
+	{
+		filled.clear();
+		for (int y = 0; y < h; y++)
+		{
+			for (int x = 0; x < w; x++)
+			{
+				if (colored[y * w + x])
+					continue;
+				int sum[3] = { 0, 0, 0 };
+				int count = 0;
+				for (int dy = std::max(y - 1, 0); dy <= std::min(y + 1, h - 1); dy++)
+				{
+					for (int dx = std::max(x - 1, 0); dx <= std::min(x + 1, w - 1); dx++)
+					{
+						if (!colored[dy * w + dx])
+							continue;
+						const unsigned char *p = pixels + (dy * w + dx) * 4;
+						sum[0] += p[0];
+						sum[1] += p[1];
+						sum[2] += p[2];
+						count++;
+					}
+				}
+				if (!count)
+					continue;
+				unsigned char *p = pixels + (y * w + x) * 4;
+				p[0] = (unsigned char)(sum[0] / count);
+				p[1] = (unsigned char)(sum[1] / count);
+				p[2] = (unsigned char)(sum[2] / count);
+				filled.push_back(y * w + x);
+			}
+		}
+		if (filled.empty())
+			break;
+		//mark after the pass, so a pass only reads colors of the previous one
+		for (int i : filled)
+			colored[i] = 1;
+	}
+}
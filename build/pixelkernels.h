@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+//per-pixel loops on RGBA8888 data, with SSE2/AVX2 versions chosen at runtime
+
+enum KernelLevel
+{
+	KERNEL_SCALAR,
+	KERNEL_SSE2,
+	//SSSE3 is needed by RGBA->RGB
+	KERNEL_SSSE3,
+	KERNEL_AVX2,
+};
+
+//best level the cpu supports
+KernelLevel getCpuKernelLevel();
+KernelLevel getKernelLevel();
+//use a lower level than the cpu supports, for comparing results and benchmarks
+void setKernelLevel(KernelLevel level);
+const char *getKernelLevelName(KernelLevel level);
+
+//find the first and last pixel with alpha > 0 in a row
+//return false if all pixels are transparent
+bool findAlphaRange(const unsigned char *row, int width, int &first, int &last);
+
+//rotate a w*h block 90 degree counterclockwise, pitches are in pixels
+//dst is h*w, dst[(w - 1 - x) * dstPitch + y] = src[y * srcPitch + x]
+void rotate90(const uint32_t *src, int srcPitch, int w, int h, uint32_t *dst, int dstPitch);
+
+//drop alpha of count pixels
+void convertRGBAToRGB(const unsigned char *src, unsigned char *dst, int count);
+
+//multiply RGB by alpha in place, for texture formats sampled with premultiplied blending
+//only scalar, simple enough for compilers to vectorize
+void premultiplyAlpha(unsigned char *pixels, int count);
+
+//give transparent pixels of a w*h image the average color of their visible neighbours, alpha stays 0
+//each pass spreads colors one pixel further, so filtering at edges doesn't bring in black
+void bleedAlpha(unsigned char *pixels, int w, int h, int passes);
@@ -0,0 +1,338 @@
+#include "pngencoder.h"
+#include "ThreadPool.h"
+#include <string.h>
+#include <stdlib.h>
+#include <wchar.h>
+#include "zlib.h"
+#include "../Bagel/Engine/bkutf8.h"
+#undef min
+#undef max
+
+using namespace std;
+
+//about this size of raw data for each stripe
+static const size_t stripeBytes = 256 * 1024;
+//deflate window
+static const size_t dictBytes = 32 * 1024;
+static const size_t fileBuffer = 1 << 20;
+
+static inline void putUInt32(unsigned char *p, uint32_t v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+static inline unsigned char paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+	if (pa <= pb && pa <= pc)
+		return (unsigned char)a;
+	if (pb <= pc)
+		return (unsigned char)b;
+	return (unsigned char)c;
+}
+
+//filter one row to out, out[0] is the filter type
+//prev is nullptr for the first row of image
+static void filterRow(int type, const unsigned char *row, const unsigned char *prev, size_t rowbytes, unsigned int bpp, unsigned char *out)
+{
+	out[0] = (unsigned char)type;
+	++out;
+	switch (type)
+	{
+	case PNGEncoder::FILTER_NONE:
+		memcpy(out, row, rowbytes);
+		break;
+	case PNGEncoder::FILTER_SUB:
+		memcpy(out, row, bpp);
+		for (size_t i = bpp; i < rowbytes; i++)
+			out[i] = row[i] - row[i - bpp];
+		break;
+	case PNGEncoder::FILTER_UP:
+		for (size_t i = 0; i < rowbytes; i++)
+			out[i] = row[i] - (prev ? prev[i] : 0);
+		break;
+	case PNGEncoder::FILTER_AVG:
+		for (size_t i = 0; i < rowbytes; i++)
+		{
+			int left = i >= bpp ? row[i - bpp] : 0;
+			int up = prev ? prev[i] : 0;
+			out[i] = row[i] - (unsigned char)((left + up) >> 1);
+		}
+		break;
+	case PNGEncoder::FILTER_PAETH:
+		for (size_t i = 0; i < rowbytes; i++)
+		{
+			int left = i >= bpp ? row[i - bpp] : 0;
+			int up = prev ? prev[i] : 0;
+			int upleft = (prev && i >= bpp) ? prev[i - bpp] : 0;
+			out[i] = row[i] - paeth(left, up, upleft);
+		}
+		break;
+	}
+}
+
+static size_t filterCost(const unsigned char *out, size_t rowbytes)
+{
+	size_t sum = 0;
+	for (size_t i = 1; i <= rowbytes; i++)
+		sum += out[i] < 128 ? out[i] : 256 - out[i];
+	return sum;
+}
+
+struct EncodedStripe
+{
+	vector<unsigned char> filtered;
+	vector<unsigned char> deflated;
+	unsigned long adler;
+	bool ok;
+};
+
+static void filterStripe(int filter, const unsigned char *rows, const unsigned char *prev, unsigned int n, size_t rowbytes, unsigned int bpp, EncodedStripe &stripe)
+{
+	stripe.filtered.resize(n * (rowbytes + 1));
+	vector<unsigned char> tmp;
+	if (filter == PNGEncoder::FILTER_ADAPTIVE)
+		tmp.resize(rowbytes + 1);
+	for (unsigned int y = 0; y < n; y++)
+	{
+		const unsigned char *row = rows + y * rowbytes;
+		const unsigned char *up = y ? row - rowbytes : prev;
+		unsigned char *out = &stripe.filtered[y * (rowbytes + 1)];
+		if (filter != PNGEncoder::FILTER_ADAPTIVE)
+		{
+			filterRow(filter, row, up, rowbytes, bpp, out);
+			continue;
+		}
+		filterRow(PNGEncoder::FILTER_NONE, row, up, rowbytes, bpp, out);
+		size_t best = filterCost(out, rowbytes);
+		for (int type = PNGEncoder::FILTER_SUB; type <= PNGEncoder::FILTER_PAETH; type++)
+		{
+			filterRow(type, row, up, rowbytes, bpp, tmp.data());
+			size_t cost = filterCost(tmp.data(), rowbytes);
+			if (cost < best)
+			{
+				best = cost;
+				memcpy(out, tmp.data(), rowbytes + 1);
+			}
+		}
+	}
+}
+
+//raw deflate ended by a sync flush, so stripes can be joined
+static void deflateStripe(int level, int strategy, const unsigned char *dict, size_t dictLen, EncodedStripe &stripe)
+{
+	stripe.ok = false;
+	stripe.adler = adler32(adler32(0, Z_NULL, 0), stripe.filtered.data(), (uInt)stripe.filtered.size());
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, strategy) != Z_OK)
+		return;
+	if (dictLen)
+		deflateSetDictionary(&zs, dict, (uInt)dictLen);
+	stripe.deflated.resize(deflateBound(&zs, (uLong)stripe.filtered.size()) + 64);
+	zs.next_in = stripe.filtered.data();
+	zs.avail_in = (uInt)stripe.filtered.size();
+	size_t done = 0;
+	for (;;)
+	{
+		zs.next_out = stripe.deflated.data() + done;
+		zs.avail_out = (uInt)(stripe.deflated.size() - done);
+		int res = deflate(&zs, Z_SYNC_FLUSH);
+		done = stripe.deflated.size() - zs.avail_out;
+		if (res != Z_OK && res != Z_BUF_ERROR)
+			break;
+		if (zs.avail_out)
+		{
+			stripe.ok = true;
+			break;
+		}
+		stripe.deflated.resize(stripe.deflated.size() * 2);
+	}
+	deflateEnd(&zs);
+	stripe.deflated.resize(done);
+}
+
+PNGEncoder::PNGEncoder(int nLevel, Filter nFilter)
+: f(NULL)
+, level(nLevel)
+, filter(nFilter)
+, w(0)
+, h(0)
+, channels(4)
+, rowbytes(0)
+, rowsWritten(0)
+, adler(1)
+, failed(false)
+{
+	if (level < 0 || level > 9)
+		level = Z_DEFAULT_COMPRESSION;
+}
+
+PNGEncoder::~PNGEncoder()
+{
+	if (f)
+		fclose(f);
+}
+
+int PNGEncoder::parseFilter(const wchar_t *name)
+{
+	static const wchar_t *names[] = { L"none", L"sub", L"up", L"avg", L"paeth", L"adaptive" };
+	for (int i = 0; i <= FILTER_ADAPTIVE; i++)
+	{
+		if (!wcscmp(names[i], name))
+			return i;
+	}
+	return -1;
+}
+
+void PNGEncoder::writeChunk(const char *type, const unsigned char *data, size_t len)
+{
+	unsigned char head[8];
+	putUInt32(head, (uint32_t)len);
+	memcpy(head + 4, type, 4);
+	uLong crc = crc32(0, (const Bytef *)type, 4);
+	if (len)
+		crc = crc32(crc, data, (uInt)len);
+	unsigned char tail[4];
+	putUInt32(tail, (uint32_t)crc);
+	if (fwrite(head, 8, 1, f) != 1 || (len && fwrite(data, len, 1, f) != 1) || fwrite(tail, 4, 1, f) != 1)
+		failed = true;
+}
+
+bool PNGEncoder::begin(const wstring &pszFilePath, unsigned int nWidth, unsigned int nHeight, unsigned int nChannels)
+{
+#ifdef _WIN32
+	f = _wfopen(pszFilePath.c_str(), L"wb");
+#else
+	f = fopen(UniToUTF8(pszFilePath).c_str(), "wb");
+#endif
+	if (!f)
+		return false;
+	setvbuf(f, NULL, _IOFBF, fileBuffer);
+	w = nWidth;
+	h = nHeight;
+	channels = nChannels;
+	rowbytes = (size_t)w * channels;
+	rowsWritten = 0;
+	lastRow.clear();
+	dict.clear();
+	adler = adler32(0, Z_NULL, 0);
+	failed = false;
+
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A };
+	if (fwrite(signature, 8, 1, f) != 1)
+		failed = true;
+	unsigned char ihdr[13];
+	putUInt32(ihdr, w);
+	putUInt32(ihdr + 4, h);
+	ihdr[8] = 8;
+	ihdr[9] = channels == 4 ? 6 : 2;
+	ihdr[10] = 0;
+	ihdr[11] = 0;
+	ihdr[12] = 0;
+	writeChunk("IHDR", ihdr, 13);
+
+	//zlib header
+	int flevel = level == Z_DEFAULT_COMPRESSION ? 2 : level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+	unsigned char zhead[2];
+	zhead[0] = 0x78;
+	zhead[1] = (unsigned char)(flevel << 6);
+	zhead[1] += (31 - (zhead[0] * 256 + zhead[1]) % 31) % 31;
+	writeChunk("IDAT", zhead, 2);
+	return !failed;
+}
+
+bool PNGEncoder::writeRows(const unsigned char *pData, unsigned int nRows)
+{
+	if (!f || failed)
+		return false;
+	if (nRows > h - rowsWritten)
+		nRows = h - rowsWritten;
+	if (!nRows)
+		return true;
+	unsigned int stripeRows = (unsigned int)(stripeBytes / rowbytes);
+	if (stripeRows < 1)
+		stripeRows = 1;
+	unsigned int count = (nRows + stripeRows - 1) / stripeRows;
+	vector<EncodedStripe> stripes(count);
+	ThreadPool &tp = ThreadPool::getInstance();
+
+	//filter
+	tp.parallel_for(0, count, [&](size_t i) {
+		unsigned int start = (unsigned int)i * stripeRows;
+		unsigned int n = min(stripeRows, nRows - start);
+		const unsigned char *rows = pData + start * rowbytes;
+		const unsigned char *prev = start ? rows - rowbytes : (lastRow.empty() ? nullptr : lastRow.data());
+		filterStripe(filter, rows, prev, n, rowbytes, channels, stripes[i]);
+	});
+
+	//deflate, every stripe uses the end of the previous one as dictionary
+	int strategy = filter == FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+	tp.parallel_for(0, count, [&](size_t i) {
+		const unsigned char *d;
+		size_t dlen;
+		if (i)
+		{
+			auto &prev = stripes[i - 1].filtered;
+			dlen = min(prev.size(), dictBytes);
+			d = prev.data() + prev.size() - dlen;
+		}
+		else
+		{
+			dlen = dict.size();
+			d = dict.data();
+		}
+		deflateStripe(level, strategy, d, dlen, stripes[i]);
+	});
+
+	for (auto &it : stripes)
+	{
+		if (!it.ok)
+		{
+			failed = true;
+			return false;
+		}
+		adler = adler32_combine(adler, it.adler, (z_off_t)it.filtered.size());
+		writeChunk("IDAT", it.deflated.data(), it.deflated.size());
+	}
+
+	//keep the last row and the dictionary for next call
+	lastRow.assign(pData + (nRows - 1) * rowbytes, pData + nRows * rowbytes);
+	vector<unsigned char> tail;
+	for (auto it = stripes.rbegin(); it != stripes.rend() && tail.size() < dictBytes; ++it)
+	{
+		size_t take = min(dictBytes - tail.size(), it->filtered.size());
+		tail.insert(tail.begin(), it->filtered.end() - take, it->filtered.end());
+	}
+	if (tail.size() < dictBytes)
+	{
+		size_t take = min(dictBytes - tail.size(), dict.size());
+		tail.insert(tail.begin(), dict.end() - take, dict.end());
+	}
+	dict.swap(tail);
+	rowsWritten += nRows;
+	return !failed;
+}
+
+bool PNGEncoder::end()
+{
+	if (!f)
+		return false;
+	if (rowsWritten != h)
+		failed = true;
+	//an empty final stored block, then adler32 of all filtered data
+	unsigned char zend[9] = { 0x01, 0x00, 0x00, 0xFF, 0xFF };
+	putUInt32(zend + 5, (uint32_t)adler);
+	writeChunk("IDAT", zend, 9);
+	writeChunk("IEND", NULL, 0);
+	if (fclose(f))
+		failed = true;
+	f = NULL;
+	return !failed;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+
+//multi-threaded png encoder
+//rows are cut into stripes, every stripe is filtered and deflated on the ThreadPool,
+//and the deflate streams are joined by sync flush like pigz, so the output is a normal png
+class PNGEncoder
+{
+public:
+	enum Filter
+	{
+		FILTER_NONE,
+		FILTER_SUB,
+		FILTER_UP,
+		FILTER_AVG,
+		FILTER_PAETH,
+		//choose the filter with minimum sum of absolute differences for each row
+		FILTER_ADAPTIVE,
+	};
+
+	PNGEncoder(int nLevel = 6, Filter nFilter = FILTER_ADAPTIVE);
+	~PNGEncoder();
+
+	//nChannels is 3 for RGB and 4 for RGBA
+	bool begin(const std::wstring &pszFilePath, unsigned int nWidth, unsigned int nHeight, unsigned int nChannels);
+	//rows go from top to bottom, may be called many times until all rows are written
+	bool writeRows(const unsigned char *pData, unsigned int nRows);
+	bool end();
+
+	//return -1 if name is invalid
+	static int parseFilter(const wchar_t *name);
+
+private:
+	void writeChunk(const char *type, const unsigned char *data, size_t len);
+
+	FILE *f;
+	int level;
+	Filter filter;
+	unsigned int w, h;
+	unsigned int channels;
+	size_t rowbytes;
+	unsigned int rowsWritten;
+	//raw data of the last row written, for filters use the row above
+	std::vector<unsigned char> lastRow;
+	//tail of filtered data written, as the dictionary of next stripe
+	std::vector<unsigned char> dict;
+	unsigned long adler;
+	bool failed;
+
+	// noncopyable
+	PNGEncoder(const PNGEncoder&) = delete;
+	PNGEncoder &operator = (const PNGEncoder&) = delete;
+};
@@ -0,0 +1,198 @@
+#include "profiler.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <stdio.h>
+#include "../Bagel/Engine/bkutf8.h"
+#ifdef _WIN32
+#define _WINSOCKAPI_
+#include <Windows.h>
+#include <psapi.h>
+#else
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+
+static const char *phaseNames[Profiler::PHASE_COUNT] = {
+	"getFiles",
+	"load",
+	"decodePng",
+	"decodeJpeg",
+	"findBounding",
+	"hash",
+	"trim",
+	"tile",
+	"pack",
+	"packAttempt",
+	"blit",
+	"encode",
+	"saveData",
+};
+
+static const char *counterNames[Profiler::COUNTER_COUNT] = {
+	"files",
+	"images",
+	"cacheHits",
+	"decodedPixels",
+	"tiles",
+	"uniqueTiles",
+	"pages",
+	"outputBytes",
+};
+
+struct PhaseStat
+{
+	atomic<int64_t> calls;
+	atomic<int64_t> wall;
+	atomic<int64_t> cpu;
+	atomic<int64_t> maxWall;
+};
+
+static bool profiling = false;
+static int64_t startWall;
+static int64_t startCpu;
+static PhaseStat phases[Profiler::PHASE_COUNT];
+static atomic<int64_t> counters[Profiler::COUNTER_COUNT];
+
+//cpu time of all threads
+static int64_t getProcessCpuTime()
+{
+#ifdef _WIN32
+	FILETIME c, e, k, u;
+	if (!GetProcessTimes(GetCurrentProcess(), &c, &e, &k, &u))
+		return 0;
+	int64_t kt = ((int64_t)k.dwHighDateTime << 32) | k.dwLowDateTime;
+	int64_t ut = ((int64_t)u.dwHighDateTime << 32) | u.dwLowDateTime;
+	return (kt + ut) * 100;
+#else
+	struct timespec ts;
+	if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts))
+		return 0;
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+void Profiler::enable()
+{
+	for (auto &it : phases)
+	{
+		it.calls = 0;
+		it.wall = 0;
+		it.cpu = 0;
+		it.maxWall = 0;
+	}
+	for (auto &it : counters)
+		it = 0;
+	startWall = getWallTime();
+	startCpu = getProcessCpuTime();
+	profiling = true;
+}
+
+bool Profiler::isEnabled()
+{
+	return profiling;
+}
+
+void Profiler::addTime(Phase phase, int64_t wallNs, int64_t cpuNs)
+{
+	auto &p = phases[phase];
+	p.calls++;
+	p.wall += wallNs;
+	p.cpu += cpuNs;
+	int64_t m = p.maxWall;
+	while (wallNs > m && !p.maxWall.compare_exchange_weak(m, wallNs))
+		;
+}
+
+void Profiler::count(Counter counter, int64_t n)
+{
+	if (profiling)
+		counters[counter] += n;
+}
+
+int64_t Profiler::getThreadCpuTime()
+{
+#ifdef _WIN32
+	FILETIME c, e, k, u;
+	if (!GetThreadTimes(GetCurrentThread(), &c, &e, &k, &u))
+		return 0;
+	int64_t kt = ((int64_t)k.dwHighDateTime << 32) | k.dwLowDateTime;
+	int64_t ut = ((int64_t)u.dwHighDateTime << 32) | u.dwLowDateTime;
+	return (kt + ut) * 100;
+#else
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+		return 0;
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+int64_t Profiler::getWallTime()
+{
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int64_t Profiler::getPeakRSS()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		return 0;
+	return pmc.PeakWorkingSetSize;
+#else
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru))
+		return 0;
+#ifdef __APPLE__
+	return ru.ru_maxrss;
+#else
+	//in KB
+	return (int64_t)ru.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+static double toMs(int64_t ns)
+{
+	return ns / 1e6;
+}
+
+bool Profiler::saveReport(const wstring &file)
+{
+	if (!profiling)
+		return false;
+	FILE *f;
+#ifdef _WIN32
+	f = _wfopen(file.c_str(), L"w");
+#else
+	f = fopen(UniToUTF8(file).c_str(), "w");
+#endif
+	if (!f)
+		return false;
+	//names are plain ascii, no need to escape
+	fprintf(f, "{\n");
+	fprintf(f, "\t\"version\": 1,\n");
+	fprintf(f, "\t\"hardwareThreads\": %u,\n", thread::hardware_concurrency());
+	fprintf(f, "\t\"wallMs\": %.3f,\n", toMs(getWallTime() - startWall));
+	fprintf(f, "\t\"cpuMs\": %.3f,\n", toMs(getProcessCpuTime() - startCpu));
+	fprintf(f, "\t\"peakRssBytes\": %lld,\n", (long long)getPeakRSS());
+	fprintf(f, "\t\"phases\": {\n");
+	for (int i = 0; i < PHASE_COUNT; i++)
+	{
+		auto &p = phases[i];
+		fprintf(f, "\t\t\"%s\": { \"calls\": %lld, \"wallMs\": %.3f, \"cpuMs\": %.3f, \"maxWallMs\": %.3f }%s\n", phaseNames[i],
+			(long long)p.calls.load(), toMs(p.wall), toMs(p.cpu), toMs(p.maxWall), i + 1 < PHASE_COUNT ? "," : "");
+	}
+	fprintf(f, "\t},\n");
+	fprintf(f, "\t\"counters\": {\n");
+	for (int i = 0; i < COUNTER_COUNT; i++)
+	{
+		fprintf(f, "\t\t\"%s\": %lld%s\n", counterNames[i], (long long)counters[i].load(), i + 1 < COUNTER_COUNT ? "," : "");
+	}
+	fprintf(f, "\t}\n");
+	fprintf(f, "}\n");
+	return fclose(f) == 0;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <string>
+#include <stdint.h>
+
+//per-phase timers and counters for --profile, saved as a json report
+//phases may run on many threads at once, their times are summed over threads,
+//so a parallel phase can take more time than the whole run
+class Profiler
+{
+public:
+	enum Phase
+	{
+		PHASE_GETFILES,
+		PHASE_LOAD,
+		PHASE_DECODE_PNG,
+		PHASE_DECODE_JPEG,
+		PHASE_BOUNDING,
+		PHASE_HASH,
+		//rotation or crop to bounding
+		PHASE_TRIM,
+		PHASE_TILE,
+		PHASE_PACK,
+		//one packer on one canvas size
+		PHASE_PACK_ATTEMPT,
+		PHASE_BLIT,
+		PHASE_ENCODE,
+		PHASE_SAVE_DATA,
+		PHASE_COUNT
+	};
+
+	enum Counter
+	{
+		COUNTER_FILES,
+		COUNTER_IMAGES,
+		COUNTER_CACHE_HITS,
+		COUNTER_DECODED_PIXELS,
+		COUNTER_TILES,
+		COUNTER_UNIQUE_TILES,
+		COUNTER_PAGES,
+		COUNTER_OUTPUT_BYTES,
+		COUNTER_COUNT
+	};
+
+	//nothing is recorded until enabled, start of the run is taken here
+	static void enable();
+	static bool isEnabled();
+
+	static void addTime(Phase phase, int64_t wallNs, int64_t cpuNs);
+	static void count(Counter counter, int64_t n = 1);
+
+	//cpu time of the calling thread
+	static int64_t getThreadCpuTime();
+	static int64_t getWallTime();
+	static int64_t getPeakRSS();
+
+	static bool saveReport(const std::wstring &file);
+};
+
+//add the time of a scope to a phase
+class ProfileScope
+{
+public:
+	explicit ProfileScope(Profiler::Phase phase)
+	: phase(phase)
+	, active(Profiler::isEnabled())
+	{
+		if (active)
+		{
+			wall = Profiler::getWallTime();
+			cpu = Profiler::getThreadCpuTime();
+		}
+	}
+	~ProfileScope()
+	{
+		if (active)
+			Profiler::addTime(phase, Profiler::getWallTime() - wall, Profiler::getThreadCpuTime() - cpu);
+	}
+
+private:
+	Profiler::Phase phase;
+	bool active;
+	int64_t wall;
+	int64_t cpu;
+
+	// noncopyable
+	ProfileScope(const ProfileScope&) = delete;
+	ProfileScope &operator = (const ProfileScope&) = delete;
+};
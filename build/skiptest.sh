@@ -0,0 +1,52 @@
+#!/bin/sh
+#standalone check of the pack cache skip path, not a part of ImagePacker
+#usage:
+#  sh skiptest.sh path/to/ImagePacker path/to/benchmark
+#a synthetic corpus is packed twice with the same options, the second run must say the layout is unchanged
+#then it's packed again without the cache by 1 and by many threads, the outputs must be the same
+#exit code is the count of failures
+packer=$1
+bench=$2
+if [ -z "$packer" ] || [ -z "$bench" ]; then
+	echo "usage: $0 path/to/ImagePacker path/to/benchmark"
+	exit 1
+fi
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+"$bench" corpus "$work/in" -count 300 -minsize 4 -maxsize 96 -dup 0.2 -seed 7 > /dev/null || exit 1
+
+failures=0
+fail()
+{
+	echo "FAIL $1"
+	failures=$((failures + 1))
+}
+
+check()
+{
+	name=$1
+	shift
+	out="$work/$name"
+	rm -f "$out".*
+	"$packer" -d "$work/in" -o "$out" -format json -j 8 "$@" > "$work/log1" || fail "$name: first run"
+	cp "$out.json" "$work/first.json"
+	"$packer" -d "$work/in" -o "$out" -format json -j 8 "$@" > "$work/log2" || fail "$name: second run"
+	grep -q "Layout is unchanged" "$work/log2" || fail "$name: second run didn't skip"
+	cmp -s "$out.json" "$work/first.json" || fail "$name: second run changed the json"
+	#without cache, the order of threads mustn't matter
+	rm -rf "$work/j1" "$work/j8"
+	mkdir "$work/j1" "$work/j8"
+	"$packer" -d "$work/in" -o "$work/j1/$name" -format json -j 1 --nocache "$@" > /dev/null || fail "$name: -j 1 run"
+	"$packer" -d "$work/in" -o "$work/j8/$name" -format json -j 8 --nocache "$@" > /dev/null || fail "$name: -j 8 run"
+	diff -rq "$work/j1" "$work/j8" > /dev/null || fail "$name: -j 1 and -j 8 outputs differ"
+	echo "$name: done"
+}
+
+check plain
+check compact -compact
+check tile -tile 16
+check membudget -membudget 1M -compact
+check pages -maxwidth 256
+
+echo "$failures failures"
+exit $failures
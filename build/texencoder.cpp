@@ -0,0 +1,840 @@
+#include "texencoder.h"
+#include "ThreadPool.h"
+#include <string.h>
+#include <math.h>
+#include <wchar.h>
+#include "../Bagel/Engine/bkutf8.h"
+#undef min
+#undef max
+
+using namespace std;
+
+static const size_t fileBuffer = 1 << 20;
+
+static inline int clamp255(int v)
+{
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+//block[i] is the pixel at x = i % 4, y = i / 4
+static inline void loadBlock(const uint32_t *pixels, int pitch, unsigned char block[16][4])
+{
+	for (int y = 0; y < 4; y++)
+		memcpy(block[y * 4], pixels + y * pitch, 16);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// BC1/BC3
+//////////////////////////////////////////////////////////////////////////
+
+static inline uint16_t packRGB565(float r, float g, float b)
+{
+	int r5 = (clamp255((int)(r + 0.5f)) * 31 + 127) / 255;
+	int g6 = (clamp255((int)(g + 0.5f)) * 63 + 127) / 255;
+	int b5 = (clamp255((int)(b + 0.5f)) * 31 + 127) / 255;
+	return (uint16_t)(r5 << 11 | g6 << 5 | b5);
+}
+
+static inline void unpackRGB565(uint16_t c, int rgb[3])
+{
+	int r = c >> 11, g = (c >> 5) & 63, b = c & 31;
+	rgb[0] = r << 3 | r >> 2;
+	rgb[1] = g << 2 | g >> 4;
+	rgb[2] = b << 3 | b >> 2;
+}
+
+//choose indices for the endpoints, return the error
+//4 colors if !threeColor, otherwise 3 colors and index 3 for pixels not in mask
+static int pickColorIndices(const unsigned char block[16][4], const bool *mask, uint16_t c0, uint16_t c1, bool threeColor, int indices[16])
+{
+	int pal[4][3];
+	unpackRGB565(c0, pal[0]);
+	unpackRGB565(c1, pal[1]);
+	int n = threeColor ? 3 : 4;
+	for (int k = 0; k < 3; k++)
+	{
+		if (threeColor)
+		{
+			pal[2][k] = (pal[0][k] + pal[1][k]) / 2;
+		}
+		else
+		{
+			pal[2][k] = (2 * pal[0][k] + pal[1][k]) / 3;
+			pal[3][k] = (pal[0][k] + 2 * pal[1][k]) / 3;
+		}
+	}
+	int err = 0;
+	for (int i = 0; i < 16; i++)
+	{
+		if (!mask[i])
+		{
+			indices[i] = 3;
+			continue;
+		}
+		int best = 0, bestErr = INT32_MAX;
+		for (int j = 0; j < n; j++)
+		{
+			int dr = block[i][0] - pal[j][0];
+			int dg = block[i][1] - pal[j][1];
+			int db = block[i][2] - pal[j][2];
+			int e = dr * dr + dg * dg + db * db;
+			if (e < bestErr)
+			{
+				bestErr = e;
+				best = j;
+			}
+		}
+		indices[i] = best;
+		err += bestErr;
+	}
+	return err;
+}
+
+//endpoints along the principal axis of colors in mask
+static void findColorEndpoints(const unsigned char block[16][4], const bool *mask, float e0[3], float e1[3])
+{
+	float mean[3] = { 0, 0, 0 };
+	int count = 0;
+	for (int i = 0; i < 16; i++)
+	{
+		if (!mask[i])
+			continue;
+		for (int k = 0; k < 3; k++)
+			mean[k] += block[i][k];
+		count++;
+	}
+	for (int k = 0; k < 3; k++)
+		mean[k] /= count;
+	float cov[6] = { 0, 0, 0, 0, 0, 0 };
+	for (int i = 0; i < 16; i++)
+	{
+		if (!mask[i])
+			continue;
+		float r = block[i][0] - mean[0], g = block[i][1] - mean[1], b = block[i][2] - mean[2];
+		cov[0] += r * r;
+		cov[1] += r * g;
+		cov[2] += r * b;
+		cov[3] += g * g;
+		cov[4] += g * b;
+		cov[5] += b * b;
+	}
+	//power iteration
+	float axis[3] = { 1, 1, 1 };
+	for (int it = 0; it < 8; it++)
+	{
+		float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+		float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+		float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+		float len = max(fabsf(x), max(fabsf(y), fabsf(z)));
+		if (len < 1e-6f)
+			break;
+		axis[0] = x / len;
+		axis[1] = y / len;
+		axis[2] = z / len;
+	}
+	float len2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+	float tmin = 0, tmax = 0;
+	for (int i = 0; i < 16; i++)
+	{
+		if (!mask[i])
+			continue;
+		float t = ((block[i][0] - mean[0]) * axis[0] + (block[i][1] - mean[1]) * axis[1] + (block[i][2] - mean[2]) * axis[2]) / len2;
+		tmin = min(tmin, t);
+		tmax = max(tmax, t);
+	}
+	for (int k = 0; k < 3; k++)
+	{
+		e0[k] = mean[k] + axis[k] * tmax;
+		e1[k] = mean[k] + axis[k] * tmin;
+	}
+}
+
+//least squares endpoints for the chosen indices, return false if indices don't decide them
+static bool refineColorEndpoints(const unsigned char block[16][4], const bool *mask, const int indices[16], bool threeColor, float e0[3], float e1[3])
+{
+	static const float weights4[4] = { 1.0f, 0.0f, 2.0f / 3, 1.0f / 3 };
+	static const float weights3[4] = { 1.0f, 0.0f, 0.5f, 0.0f };
+	const float *weights = threeColor ? weights3 : weights4;
+	float aa = 0, bb = 0, ab = 0;
+	float ap[3] = { 0, 0, 0 }, bp[3] = { 0, 0, 0 };
+	for (int i = 0; i < 16; i++)
+	{
+		if (!mask[i])
+			continue;
+		float a = weights[indices[i]];
+		float b = 1 - a;
+		aa += a * a;
+		bb += b * b;
+		ab += a * b;
+		for (int k = 0; k < 3; k++)
+		{
+			ap[k] += a * block[i][k];
+			bp[k] += b * block[i][k];
+		}
+	}
+	float det = aa * bb - ab * ab;
+	if (fabsf(det) < 1e-6f)
+		return false;
+	for (int k = 0; k < 3; k++)
+	{
+		e0[k] = (ap[k] * bb - bp[k] * ab) / det;
+		e1[k] = (bp[k] * aa - ap[k] * ab) / det;
+	}
+	return true;
+}
+
+//8 bytes of color, for BC1 pixels not in mask are transparent and the 3 colors mode is used
+static void encodeColorBlock(const unsigned char block[16][4], const bool *mask, bool threeColor, unsigned char *out)
+{
+	uint16_t c0 = 0, c1 = 0;
+	int indices[16];
+	bool any = false;
+	for (int i = 0; i < 16; i++)
+		any |= mask[i];
+	if (!any)
+	{
+		//all transparent
+		for (int i = 0; i < 16; i++)
+			indices[i] = 3;
+	}
+	else
+	{
+		float e0[3], e1[3];
+		findColorEndpoints(block, mask, e0, e1);
+		c0 = packRGB565(e0[0], e0[1], e0[2]);
+		c1 = packRGB565(e1[0], e1[1], e1[2]);
+		int err = pickColorIndices(block, mask, c0, c1, threeColor, indices);
+		if (err > 0 && refineColorEndpoints(block, mask, indices, threeColor, e0, e1))
+		{
+			uint16_t r0 = packRGB565(e0[0], e0[1], e0[2]);
+			uint16_t r1 = packRGB565(e1[0], e1[1], e1[2]);
+			int refined[16];
+			if (pickColorIndices(block, mask, r0, r1, threeColor, refined) < err)
+			{
+				c0 = r0;
+				c1 = r1;
+				memcpy(indices, refined, sizeof(indices));
+			}
+		}
+	}
+	//the order of endpoints decides the mode, c0 > c1 for 4 colors and c0 <= c1 for 3 colors
+	if (c0 == c1)
+	{
+		for (int i = 0; i < 16; i++)
+		{
+			if (mask[i])
+				indices[i] = 0;
+		}
+	}
+	else if ((c0 < c1) != threeColor)
+	{
+		swap(c0, c1);
+		for (int i = 0; i < 16; i++)
+		{
+			//0 and 1 are the endpoints, 3 is transparent in the 3 colors mode
+			if (indices[i] < 2 || !threeColor)
+				indices[i] ^= 1;
+		}
+	}
+	uint32_t bits = 0;
+	for (int i = 0; i < 16; i++)
+		bits |= (uint32_t)indices[i] << (2 * i);
+	out[0] = (unsigned char)c0;
+	out[1] = (unsigned char)(c0 >> 8);
+	out[2] = (unsigned char)c1;
+	out[3] = (unsigned char)(c1 >> 8);
+	out[4] = (unsigned char)bits;
+	out[5] = (unsigned char)(bits >> 8);
+	out[6] = (unsigned char)(bits >> 16);
+	out[7] = (unsigned char)(bits >> 24);
+}
+
+//return the error of alpha for endpoints, with indices
+static int pickAlphaIndices(const unsigned char block[16][4], int a0, int a1, int indices[16])
+{
+	int pal[8];
+	pal[0] = a0;
+	pal[1] = a1;
+	if (a0 > a1)
+	{
+		for (int i = 2; i < 8; i++)
+			pal[i] = ((8 - i) * a0 + (i - 1) * a1) / 7;
+	}
+	else
+	{
+		for (int i = 2; i < 6; i++)
+			pal[i] = ((6 - i) * a0 + (i - 1) * a1) / 5;
+		pal[6] = 0;
+		pal[7] = 255;
+	}
+	int err = 0;
+	for (int i = 0; i < 16; i++)
+	{
+		int best = 0, bestErr = INT32_MAX;
+		for (int j = 0; j < 8; j++)
+		{
+			int d = block[i][3] - pal[j];
+			if (d * d < bestErr)
+			{
+				bestErr = d * d;
+				best = j;
+			}
+		}
+		indices[i] = best;
+		err += bestErr;
+	}
+	return err;
+}
+
+static void encodeAlphaBlock(const unsigned char block[16][4], unsigned char *out)
+{
+	int amin = 255, amax = 0;
+	//range without 0 and 255, for the 6 alpha mode which has them for free
+	int imin = 255, imax = 0;
+	for (int i = 0; i < 16; i++)
+	{
+		int a = block[i][3];
+		amin = min(amin, a);
+		amax = max(amax, a);
+		if (a != 0 && a != 255)
+		{
+			imin = min(imin, a);
+			imax = max(imax, a);
+		}
+	}
+	int a0 = amax, a1 = amin;
+	int indices[16];
+	int err = pickAlphaIndices(block, a0, a1, indices);
+	if (err > 0)
+	{
+		if (imin > imax)
+			imin = imax = 0;
+		int other[16];
+		if (pickAlphaIndices(block, imin, imax, other) < err)
+		{
+			a0 = imin;
+			a1 = imax;
+			memcpy(indices, other, sizeof(indices));
+		}
+	}
+	out[0] = (unsigned char)a0;
+	out[1] = (unsigned char)a1;
+	uint64_t bits = 0;
+	for (int i = 0; i < 16; i++)
+		bits |= (uint64_t)indices[i] << (3 * i);
+	for (int i = 0; i < 6; i++)
+		out[2 + i] = (unsigned char)(bits >> (8 * i));
+}
+
+void encodeBC1Block(const uint32_t *pixels, int pitch, unsigned char *out)
+{
+	unsigned char block[16][4];
+	loadBlock(pixels, pitch, block);
+	bool mask[16];
+	bool threeColor = false;
+	for (int i = 0; i < 16; i++)
+	{
+		mask[i] = block[i][3] >= 128;
+		threeColor |= !mask[i];
+	}
+	encodeColorBlock(block, mask, threeColor, out);
+}
+
+void encodeBC3Block(const uint32_t *pixels, int pitch, unsigned char *out)
+{
+	unsigned char block[16][4];
+	loadBlock(pixels, pitch, block);
+	encodeAlphaBlock(block, out);
+	//colors of invisible pixels don't matter, unless all are invisible
+	bool mask[16];
+	bool any = false;
+	for (int i = 0; i < 16; i++)
+	{
+		mask[i] = block[i][3] != 0;
+		any |= mask[i];
+	}
+	if (!any)
+	{
+		for (int i = 0; i < 16; i++)
+			mask[i] = true;
+	}
+	encodeColorBlock(block, mask, false, out + 8);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// ETC2
+//////////////////////////////////////////////////////////////////////////
+
+//modifiers for index 0, 1, 2, 3
+static const int etcModifiers[8][4] = {
+	{ 2, 8, -2, -8 },
+	{ 5, 17, -5, -17 },
+	{ 9, 29, -9, -29 },
+	{ 13, 42, -13, -42 },
+	{ 18, 60, -18, -60 },
+	{ 24, 80, -24, -80 },
+	{ 33, 106, -33, -106 },
+	{ 47, 183, -47, -183 },
+};
+
+static const int eacModifiers[16][8] = {
+	{ -3, -6, -9, -15, 2, 5, 8, 14 },
+	{ -3, -7, -10, -13, 2, 6, 9, 12 },
+	{ -2, -5, -8, -13, 1, 4, 7, 12 },
+	{ -2, -4, -6, -13, 1, 3, 5, 12 },
+	{ -3, -6, -8, -12, 2, 5, 7, 11 },
+	{ -3, -7, -9, -11, 2, 6, 8, 10 },
+	{ -4, -7, -8, -11, 3, 6, 7, 10 },
+	{ -3, -5, -8, -11, 2, 4, 7, 10 },
+	{ -2, -6, -8, -10, 1, 5, 7, 9 },
+	{ -2, -5, -8, -10, 1, 4, 7, 9 },
+	{ -2, -4, -8, -10, 1, 3, 7, 9 },
+	{ -2, -5, -7, -10, 1, 4, 6, 9 },
+	{ -3, -4, -7, -10, 2, 3, 6, 9 },
+	{ -1, -2, -3, -10, 0, 1, 2, 9 },
+	{ -4, -6, -8, -9, 3, 5, 7, 8 },
+	{ -3, -5, -7, -9, 2, 4, 6, 8 },
+};
+
+static inline void putUInt64BE(unsigned char *p, uint64_t v)
+{
+	for (int i = 0; i < 8; i++)
+		p[i] = (unsigned char)(v >> (56 - 8 * i));
+}
+
+//EAC alpha, indices are in column order
+static void encodeEACBlock(const unsigned char block[16][4], unsigned char *out)
+{
+	int amin = 255, amax = 0;
+	for (int i = 0; i < 16; i++)
+	{
+		amin = min(amin, (int)block[i][3]);
+		amax = max(amax, (int)block[i][3]);
+	}
+	int bestBase = amin, bestMul = 1, bestTable = 13;
+	int bestIndices[16];
+	//modifier 0 of table 13
+	for (int i = 0; i < 16; i++)
+		bestIndices[i] = 4;
+	if (amin != amax)
+	{
+		int bestErr = INT32_MAX;
+		for (int t = 0; t < 16 && bestErr; t++)
+		{
+			int lo = eacModifiers[t][3], hi = eacModifiers[t][7];
+			int m0 = (int)((amax - amin) / (float)(hi - lo) + 0.5f);
+			for (int m = max(1, m0 - 1); m <= min(15, m0 + 1) && bestErr; m++)
+			{
+				int base = clamp255((int)floorf((amin + amax - (lo + hi) * m) / 2.0f + 0.5f));
+				int err = 0;
+				int indices[16];
+				for (int i = 0; i < 16 && err < bestErr; i++)
+				{
+					int e = INT32_MAX;
+					for (int j = 0; j < 8; j++)
+					{
+						int d = block[i][3] - clamp255(base + eacModifiers[t][j] * m);
+						if (d * d < e)
+						{
+							e = d * d;
+							indices[i] = j;
+						}
+					}
+					err += e;
+				}
+				if (err < bestErr)
+				{
+					bestErr = err;
+					bestBase = base;
+					bestMul = m;
+					bestTable = t;
+					memcpy(bestIndices, indices, sizeof(indices));
+				}
+			}
+		}
+	}
+	uint64_t bits = (uint64_t)bestBase << 56 | (uint64_t)bestMul << 52 | (uint64_t)bestTable << 48;
+	for (int x = 0; x < 4; x++)
+	{
+		for (int y = 0; y < 4; y++)
+		{
+			int p = x * 4 + y;
+			bits |= (uint64_t)bestIndices[y * 4 + x] << (45 - 3 * p);
+		}
+	}
+	putUInt64BE(out, bits);
+}
+
+struct EtcSubBlock
+{
+	int table;
+	int err;
+	//index for each pixel of the block, only pixels of this sub block are set
+	int indices[16];
+};
+
+static inline bool inSubBlock(int i, bool flip, int sub)
+{
+	return ((flip ? i / 4 : i % 4) >= 2) == (sub == 1);
+}
+
+//best table for a sub block with the base color
+static void fitSubBlock(const unsigned char block[16][4], const int *weights, bool flip, int sub, const int base[3], EtcSubBlock &res)
+{
+	res.err = INT32_MAX;
+	for (int t = 0; t < 8; t++)
+	{
+		int err = 0;
+		int indices[16];
+		for (int i = 0; i < 16; i++)
+		{
+			if (!inSubBlock(i, flip, sub))
+				continue;
+			int e = INT32_MAX;
+			for (int j = 0; j < 4; j++)
+			{
+				int dr = block[i][0] - clamp255(base[0] + etcModifiers[t][j]);
+				int dg = block[i][1] - clamp255(base[1] + etcModifiers[t][j]);
+				int db = block[i][2] - clamp255(base[2] + etcModifiers[t][j]);
+				int d = (dr * dr + dg * dg + db * db) * weights[i];
+				if (d < e)
+				{
+					e = d;
+					indices[i] = j;
+				}
+			}
+			err += e;
+		}
+		if (err < res.err)
+		{
+			res.err = err;
+			res.table = t;
+			memcpy(res.indices, indices, sizeof(indices));
+		}
+	}
+}
+
+static void averageSubBlock(const unsigned char block[16][4], const int *weights, bool flip, int sub, float avg[3])
+{
+	float sum[3] = { 0, 0, 0 };
+	int count = 0;
+	for (int i = 0; i < 16; i++)
+	{
+		if (!inSubBlock(i, flip, sub))
+			continue;
+		for (int k = 0; k < 3; k++)
+			sum[k] += block[i][k] * weights[i];
+		count += weights[i];
+	}
+	for (int k = 0; k < 3; k++)
+		avg[k] = count ? sum[k] / count : 0;
+}
+
+//color part with the individual or differential mode of ETC1
+static void encodeETCColorBlock(const unsigned char block[16][4], unsigned char *out)
+{
+	//colors of invisible pixels don't matter, unless all are invisible
+	int weights[16];
+	bool any = false;
+	for (int i = 0; i < 16; i++)
+	{
+		weights[i] = block[i][3] ? 1 : 0;
+		any |= weights[i] != 0;
+	}
+	if (!any)
+	{
+		for (int i = 0; i < 16; i++)
+			weights[i] = 1;
+	}
+	uint64_t best = 0;
+	int bestErr = INT32_MAX;
+	for (int flip = 0; flip < 2; flip++)
+	{
+		float avg[2][3];
+		averageSubBlock(block, weights, flip != 0, 0, avg[0]);
+		averageSubBlock(block, weights, flip != 0, 1, avg[1]);
+		for (int diff = 0; diff < 2; diff++)
+		{
+			int q[2][3], base[2][3];
+			for (int k = 0; k < 3; k++)
+			{
+				if (diff)
+				{
+					q[0][k] = (clamp255((int)(avg[0][k] + 0.5f)) * 31 + 127) / 255;
+					q[1][k] = (clamp255((int)(avg[1][k] + 0.5f)) * 31 + 127) / 255;
+					int d = q[1][k] - q[0][k];
+					d = max(-4, min(3, d));
+					q[1][k] = q[0][k] + d;
+					base[0][k] = q[0][k] << 3 | q[0][k] >> 2;
+					base[1][k] = q[1][k] << 3 | q[1][k] >> 2;
+				}
+				else
+				{
+					q[0][k] = (clamp255((int)(avg[0][k] + 0.5f)) * 15 + 127) / 255;
+					q[1][k] = (clamp255((int)(avg[1][k] + 0.5f)) * 15 + 127) / 255;
+					base[0][k] = q[0][k] << 4 | q[0][k];
+					base[1][k] = q[1][k] << 4 | q[1][k];
+				}
+			}
+			EtcSubBlock s0, s1;
+			fitSubBlock(block, weights, flip != 0, 0, base[0], s0);
+			fitSubBlock(block, weights, flip != 0, 1, base[1], s1);
+			int err = s0.err + s1.err;
+			if (err >= bestErr)
+				continue;
+			bestErr = err;
+			uint64_t bits = 0;
+			if (diff)
+			{
+				bits |= (uint64_t)q[0][0] << 59 | (uint64_t)((q[1][0] - q[0][0]) & 7) << 56;
+				bits |= (uint64_t)q[0][1] << 51 | (uint64_t)((q[1][1] - q[0][1]) & 7) << 48;
+				bits |= (uint64_t)q[0][2] << 43 | (uint64_t)((q[1][2] - q[0][2]) & 7) << 40;
+			}
+			else
+			{
+				bits |= (uint64_t)q[0][0] << 60 | (uint64_t)q[1][0] << 56;
+				bits |= (uint64_t)q[0][1] << 52 | (uint64_t)q[1][1] << 48;
+				bits |= (uint64_t)q[0][2] << 44 | (uint64_t)q[1][2] << 40;
+			}
+			bits |= (uint64_t)s0.table << 37 | (uint64_t)s1.table << 34 | (uint64_t)diff << 33 | (uint64_t)flip << 32;
+			for (int i = 0; i < 16; i++)
+			{
+				int index = inSubBlock(i, flip != 0, 0) ? s0.indices[i] : s1.indices[i];
+				//pixels are in column order
+				int p = (i % 4) * 4 + i / 4;
+				bits |= (uint64_t)(index >> 1) << (16 + p) | (uint64_t)(index & 1) << p;
+			}
+			best = bits;
+		}
+	}
+	putUInt64BE(out, best);
+}
+
+void encodeETC2Block(const uint32_t *pixels, int pitch, unsigned char *out)
+{
+	unsigned char block[16][4];
+	loadBlock(pixels, pitch, block);
+	encodeEACBlock(block, out);
+	encodeETCColorBlock(block, out + 8);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// TextureWriter
+//////////////////////////////////////////////////////////////////////////
+
+int parseTextureFormat(const wchar_t *name)
+{
+	static const wchar_t *names[] = { L"png", L"bc1", L"bc3", L"etc2", L"rgba4444" };
+	for (int i = 0; i <= TEXTURE_RGBA4444; i++)
+	{
+		if (!wcscmp(names[i], name))
+			return i;
+	}
+	return -1;
+}
+
+const wchar_t *getTextureExtension(TextureFormat format)
+{
+	switch (format)
+	{
+	case TEXTURE_BC1:
+	case TEXTURE_BC3:
+		return L".dds";
+	case TEXTURE_ETC2:
+	case TEXTURE_RGBA4444:
+		return L".ktx";
+	default:
+		return L".png";
+	}
+}
+
+bool isBlockFormat(TextureFormat format)
+{
+	return format == TEXTURE_BC1 || format == TEXTURE_BC3 || format == TEXTURE_ETC2;
+}
+
+static int getBlockBytes(TextureFormat format)
+{
+	return format == TEXTURE_BC1 ? 8 : 16;
+}
+
+static inline void putUInt32LE(unsigned char *p, uint32_t v)
+{
+	p[0] = (unsigned char)v;
+	p[1] = (unsigned char)(v >> 8);
+	p[2] = (unsigned char)(v >> 16);
+	p[3] = (unsigned char)(v >> 24);
+}
+
+TextureWriter::TextureWriter()
+: f(NULL)
+, format(TEXTURE_PNG)
+, w(0)
+, h(0)
+, rowsWritten(0)
+, failed(false)
+{
+}
+
+TextureWriter::~TextureWriter()
+{
+	if (f)
+		fclose(f);
+}
+
+bool TextureWriter::begin(const wstring &pszFilePath, TextureFormat nFormat, unsigned int nWidth, unsigned int nHeight)
+{
+	if (nFormat == TEXTURE_PNG || (isBlockFormat(nFormat) && (nWidth % 4 || nHeight % 4)))
+		return false;
+#ifdef _WIN32
+	f = _wfopen(pszFilePath.c_str(), L"wb");
+#else
+	f = fopen(UniToUTF8(pszFilePath).c_str(), "wb");
+#endif
+	if (!f)
+		return false;
+	setvbuf(f, NULL, _IOFBF, fileBuffer);
+	format = nFormat;
+	w = nWidth;
+	h = nHeight;
+	rowsWritten = 0;
+	failed = false;
+
+	if (format == TEXTURE_BC1 || format == TEXTURE_BC3)
+	{
+		//DDS_HEADER with a FourCC pixel format
+		unsigned char header[128];
+		memset(header, 0, sizeof(header));
+		memcpy(header, "DDS ", 4);
+		putUInt32LE(header + 4, 124);
+		//caps, height, width, pixel format, linear size
+		putUInt32LE(header + 8, 0x1 | 0x2 | 0x4 | 0x1000 | 0x80000);
+		putUInt32LE(header + 12, h);
+		putUInt32LE(header + 16, w);
+		putUInt32LE(header + 20, (w / 4) * (h / 4) * getBlockBytes(format));
+		putUInt32LE(header + 76, 32);
+		//DDPF_FOURCC
+		putUInt32LE(header + 80, 0x4);
+		memcpy(header + 84, format == TEXTURE_BC1 ? "DXT1" : "DXT5", 4);
+		//DDSCAPS_TEXTURE
+		putUInt32LE(header + 108, 0x1000);
+		failed = fwrite(header, sizeof(header), 1, f) != 1;
+	}
+	else
+	{
+		//KTX 1.1 with one level, followed by imageSize
+		static const unsigned char identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+		unsigned char header[68];
+		memset(header, 0, sizeof(header));
+		memcpy(header, identifier, 12);
+		putUInt32LE(header + 12, 0x04030201);
+		uint32_t imageSize;
+		if (format == TEXTURE_ETC2)
+		{
+			//glType, glTypeSize, glFormat, glInternalFormat = GL_COMPRESSED_RGBA8_ETC2_EAC
+			putUInt32LE(header + 16, 0);
+			putUInt32LE(header + 20, 1);
+			putUInt32LE(header + 24, 0);
+			putUInt32LE(header + 28, 0x9278);
+			imageSize = (w / 4) * (h / 4) * 16;
+		}
+		else
+		{
+			//GL_UNSIGNED_SHORT_4_4_4_4, GL_RGBA, GL_RGBA4
+			putUInt32LE(header + 16, 0x8033);
+			putUInt32LE(header + 20, 2);
+			putUInt32LE(header + 24, 0x1908);
+			putUInt32LE(header + 28, 0x8056);
+			//rows are 4 bytes aligned
+			imageSize = ((w * 2 + 3) & ~3u) * h;
+		}
+		//glBaseInternalFormat = GL_RGBA
+		putUInt32LE(header + 32, 0x1908);
+		putUInt32LE(header + 36, w);
+		putUInt32LE(header + 40, h);
+		//depth and array elements are 0, 1 face, 1 level, no key/value data
+		putUInt32LE(header + 52, 1);
+		putUInt32LE(header + 56, 1);
+		putUInt32LE(header + 64, imageSize);
+		failed = fwrite(header, sizeof(header), 1, f) != 1;
+	}
+	return !failed;
+}
+
+bool TextureWriter::writeRows(const unsigned char *pData, unsigned int nRows)
+{
+	if (!f || failed)
+		return false;
+	if (nRows > h - rowsWritten)
+		nRows = h - rowsWritten;
+	if (!nRows)
+		return true;
+	ThreadPool &tp = ThreadPool::getInstance();
+	const uint32_t *pixels = (const uint32_t *)pData;
+	vector<unsigned char> out;
+	if (isBlockFormat(format))
+	{
+		if (nRows % 4)
+		{
+			failed = true;
+			return false;
+		}
+		unsigned int bw = w / 4;
+		int blockBytes = getBlockBytes(format);
+		out.resize((size_t)bw * (nRows / 4) * blockBytes);
+		tp.parallel_for(0, nRows / 4, [&](size_t by) {
+			for (unsigned int bx = 0; bx < bw; bx++)
+			{
+				const uint32_t *src = pixels + by * 4 * w + bx * 4;
+				unsigned char *dst = &out[(by * bw + bx) * blockBytes];
+				switch (format)
+				{
+				case TEXTURE_BC1:
+					encodeBC1Block(src, w, dst);
+					break;
+				case TEXTURE_BC3:
+					encodeBC3Block(src, w, dst);
+					break;
+				default:
+					encodeETC2Block(src, w, dst);
+					break;
+				}
+			}
+		});
+	}
+	else
+	{
+		size_t pitch = (w * 2 + 3) & ~3u;
+		out.assign(pitch * nRows, 0);
+		tp.parallel_for(0, nRows, [&](size_t y) {
+			const unsigned char *src = pData + y * w * 4;
+			unsigned char *dst = &out[y * pitch];
+			for (unsigned int x = 0; x < w; x++)
+			{
+				int r = (src[x * 4] * 15 + 127) / 255;
+				int g = (src[x * 4 + 1] * 15 + 127) / 255;
+				int b = (src[x * 4 + 2] * 15 + 127) / 255;
+				int a = (src[x * 4 + 3] * 15 + 127) / 255;
+				uint16_t v = (uint16_t)(r << 12 | g << 8 | b << 4 | a);
+				dst[x * 2] = (unsigned char)v;
+				dst[x * 2 + 1] = (unsigned char)(v >> 8);
+			}
+		});
+	}
+	if (fwrite(out.data(), out.size(), 1, f) != 1)
+		failed = true;
+	rowsWritten += nRows;
+	return !failed;
+}
+
+bool TextureWriter::end()
+{
+	if (!f)
+		return false;
+	if (rowsWritten != h)
+		failed = true;
+	if (fclose(f))
+		failed = true;
+	f = NULL;
+	return !failed;
+}
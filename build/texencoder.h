@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+
+//gpu texture formats for batch images
+enum TextureFormat
+{
+	TEXTURE_PNG,
+	//DXT1 in dds, alpha is cut to 1 bit
+	TEXTURE_BC1,
+	//DXT5 in dds
+	TEXTURE_BC3,
+	//ETC2 RGBA8 (EAC alpha) in ktx
+	TEXTURE_ETC2,
+	//16 bits per pixel in ktx
+	TEXTURE_RGBA4444,
+};
+
+//return -1 if name is invalid
+int parseTextureFormat(const wchar_t *name);
+//with dot
+const wchar_t *getTextureExtension(TextureFormat format);
+//formats made of 4*4 blocks
+bool isBlockFormat(TextureFormat format);
+
+//encode one 4*4 block of RGBA8888 pixels, pitch is in pixels
+void encodeBC1Block(const uint32_t *pixels, int pitch, unsigned char *out);
+void encodeBC3Block(const uint32_t *pixels, int pitch, unsigned char *out);
+//color only uses the ETC1 compatible modes
+void encodeETC2Block(const uint32_t *pixels, int pitch, unsigned char *out);
+
+//write a texture file by strips of rows, like PNGEncoder
+//rows of every call except the last must be a multiple of 4 for block formats
+//blocks are encoded on the ThreadPool
+class TextureWriter
+{
+public:
+	TextureWriter();
+	~TextureWriter();
+
+	//w and h must be multiples of 4 for block formats, batch images always are
+	bool begin(const std::wstring &pszFilePath, TextureFormat nFormat, unsigned int nWidth, unsigned int nHeight);
+	bool writeRows(const unsigned char *pData, unsigned int nRows);
+	bool end();
+
+private:
+	FILE *f;
+	TextureFormat format;
+	unsigned int w, h;
+	unsigned int rowsWritten;
+	bool failed;
+
+	// noncopyable
+	TextureWriter(const TextureWriter&) = delete;
+	TextureWriter &operator = (const TextureWriter&) = delete;
+};
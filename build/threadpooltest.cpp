@@ -0,0 +1,214 @@
+//standalone stress test of ThreadPool, not a part of ImagePacker
+//build on linux:
+//  g++ -std=c++14 -O2 -pthread -fsanitize=thread threadpooltest.cpp -o threadpooltest
+//pools of 1 to 16 threads are made and destroyed over and over, a lost wakeup or a hang fails by the watchdog
+//exit code is the count of failures
+#include "ThreadPool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <stdexcept>
+
+using namespace std;
+
+static int failures = 0;
+static int checks = 0;
+
+static void check(bool ok, const char *what, int threads)
+{
+	checks++;
+	if (ok)
+		return;
+	failures++;
+	if (failures <= 20)
+		printf("FAIL %s with %d threads\n", what, threads);
+}
+
+//a pool made for the test, ThreadPool::getInstance is made only once
+static unique_ptr<ThreadPool> makePool(int threads)
+{
+	ThreadPool::setThreadCount(threads);
+	return unique_ptr<ThreadPool>(new ThreadPool());
+}
+
+//jobs come one by one with pauses between, so workers are asleep every time one is pushed
+static void testWakeup(int threads)
+{
+	auto pool = makePool(threads);
+	for (int n = 0; n < 200; n++)
+	{
+		auto f = pool->enqueue([](int a) { return a + 1; }, n);
+		check(f.wait_for(chrono::seconds(10)) == future_status::ready, "wakeup", threads);
+		check(f.get() == n + 1, "enqueue result", threads);
+		if (n % 16 == 0)
+			this_thread::sleep_for(chrono::microseconds(200));
+	}
+}
+
+//jobs pushed from threads outside the pool at the same time
+static void testManyProducers(int threads)
+{
+	auto pool = makePool(threads);
+	atomic<int> done(0);
+	vector<thread> producers;
+	for (int p = 0; p < 4; p++)
+	{
+		producers.emplace_back([&]() {
+			vector<future<void>> fs;
+			for (int n = 0; n < 500; n++)
+				fs.push_back(pool->enqueue([&]() { done++; }));
+			for (auto &f : fs)
+				f.wait();
+		});
+	}
+	for (auto &t : producers)
+		t.join();
+	check(done == 2000, "producers", threads);
+}
+
+//the destructor must run every queued job before workers leave
+static void testStop(int threads)
+{
+	for (int n = 0; n < 50; n++)
+	{
+		atomic<int> done(0);
+		{
+			auto pool = makePool(threads);
+			for (int k = 0; k < 100; k++)
+				pool->enqueue([&]() { done++; });
+		}
+		check(done == 100, "jobs run before stop", threads);
+	}
+	//destroyed right after made, while workers may not have started
+	for (int n = 0; n < 50; n++)
+		makePool(threads);
+}
+
+//parallel_for in jobs of parallel_for and of a TaskGroup, callers run queued jobs while waiting
+static void testNested(int threads)
+{
+	auto pool = makePool(threads);
+	for (int n = 0; n < 20; n++)
+	{
+		atomic<long long> sum(0);
+		pool->parallel_for(0, 64, [&](size_t i) {
+			pool->parallel_for(0, 100, [&](size_t k) {
+				sum += i * 100 + k;
+			});
+		});
+		check(sum == 6400LL * 6399 / 2, "nested parallel_for", threads);
+
+		atomic<int> count(0);
+		TaskGroup group(*pool);
+		for (int k = 0; k < 50; k++)
+		{
+			group.run([&]() {
+				TaskGroup inner(*pool);
+				for (int j = 0; j < 10; j++)
+					inner.run([&]() { count++; });
+				inner.wait();
+				pool->parallel_for(0, 10, [&](size_t) { count++; });
+			});
+		}
+		group.wait();
+		check(count == 1000, "nested TaskGroup", threads);
+	}
+}
+
+//the first exception is thrown in the caller after every job is finished
+static void testExceptions(int threads)
+{
+	auto pool = makePool(threads);
+	for (int n = 0; n < 20; n++)
+	{
+		atomic<int> count(0);
+		bool caught = false;
+		try
+		{
+			pool->parallel_for(0, 1000, [&](size_t i) {
+				count++;
+				if (i % 100 == 7)
+					throw runtime_error("parallel_for");
+			});
+		}
+		catch (const runtime_error &)
+		{
+			caught = true;
+		}
+		check(caught, "parallel_for exception", threads);
+		//a chunk stops at its exception, the others go on
+		check(count >= 10 && count <= 1000, "parallel_for after exception", threads);
+
+		caught = false;
+		TaskGroup group(*pool);
+		for (int k = 0; k < 20; k++)
+		{
+			group.run([k]() {
+				if (k == 13)
+					throw runtime_error("TaskGroup");
+			});
+		}
+		try
+		{
+			group.wait();
+		}
+		catch (const runtime_error &)
+		{
+			caught = true;
+		}
+		check(caught, "TaskGroup exception", threads);
+
+		auto f = pool->enqueue([]() -> int { throw runtime_error("enqueue"); });
+		caught = false;
+		try
+		{
+			f.get();
+		}
+		catch (const runtime_error &)
+		{
+			caught = true;
+		}
+		check(caught, "enqueue exception", threads);
+	}
+}
+
+//-j 1 starts no worker, every job runs in the calling thread
+static void testSingleThread()
+{
+	auto pool = makePool(1);
+	check(pool->getWorkerCount() == 0, "no worker", 1);
+	auto self = this_thread::get_id();
+	bool same = true;
+	pool->parallel_for(0, 1000, [&](size_t) {
+		same = same && this_thread::get_id() == self;
+	});
+	pool->enqueue([&]() { same = same && this_thread::get_id() == self; }).get();
+	TaskGroup group(*pool);
+	group.run([&]() { same = same && this_thread::get_id() == self; });
+	group.wait();
+	check(same, "jobs in the calling thread", 1);
+}
+
+int main()
+{
+	//a lost wakeup hangs instead of failing
+	thread([]() {
+		this_thread::sleep_for(chrono::minutes(5));
+		printf("FAIL timeout\n");
+		fflush(stdout);
+		_Exit(1000);
+	}).detach();
+	testSingleThread();
+	for (int threads : { 1, 2, 3, 4, 8, 16 })
+	{
+		int before = failures;
+		testWakeup(threads);
+		testManyProducers(threads);
+		testStop(threads);
+		testNested(threads);
+		testExceptions(threads);
+		printf("%d threads: %s\n", threads, failures == before ? "ok" : "FAILED");
+	}
+	printf("%d checks, %d failures\n", checks, failures);
+	return failures;
+}
@@ -0,0 +1,82 @@
+#include "tiledict.h"
+#include <string.h>
+
+using namespace std;
+
+static const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t prime3 = 0x165667B19E3779F9ULL;
+
+static inline uint64_t rotl64(uint64_t v, int r)
+{
+	return (v << r) | (v >> (64 - r));
+}
+
+//same round as xxhash64
+static inline uint64_t mixRound(uint64_t acc, uint64_t v)
+{
+	acc += v * prime2;
+	acc = rotl64(acc, 31);
+	return acc * prime1;
+}
+
+uint64_t TileDict::hashTile(const unsigned char *pixels, int pitch, int w, int h)
+{
+	uint64_t acc = prime3 ^ ((uint64_t)w << 32 | (uint32_t)h);
+	size_t len = (size_t)w * 4;
+	for (int y = 0; y < h; y++)
+	{
+		const unsigned char *row = pixels + (size_t)y * pitch;
+		size_t i = 0;
+		for (; i + 8 <= len; i += 8)
+		{
+			uint64_t v;
+			memcpy(&v, row + i, 8);
+			acc = mixRound(acc, v);
+		}
+		if (i < len)
+		{
+			uint32_t v;
+			memcpy(&v, row + i, 4);
+			acc = mixRound(acc, v);
+		}
+	}
+	acc ^= acc >> 33;
+	acc *= prime2;
+	acc ^= acc >> 29;
+	acc *= prime3;
+	acc ^= acc >> 32;
+	return acc;
+}
+
+static bool isSameTile(const TileDict::Tile &a, const unsigned char *pixels, int pitch, int w, int h)
+{
+	if (a.w != w || a.h != h)
+		return false;
+	for (int y = 0; y < h; y++)
+	{
+		if (memcmp(a.pixels + (size_t)y * a.pitch, pixels + (size_t)y * pitch, (size_t)w * 4))
+			return false;
+	}
+	return true;
+}
+
+int TileDict::add(const unsigned char *pixels, int pitch, int w, int h, uint64_t hash)
+{
+	auto range = index.equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it)
+	{
+		if (isSameTile(tiles[it->second], pixels, pitch, w, h))
+			return it->second;
+	}
+	int res = (int)tiles.size();
+	tiles.push_back({ pixels, pitch, w, h, hash });
+	index.emplace(hash, res);
+	return res;
+}
+
+void TileDict::clear()
+{
+	tiles.clear();
+	index.clear();
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <stddef.h>
+#include <stdint.h>
+
+//set of unique RGBA8888 tiles
+//tiles are found by a fast 64-bit hash and confirmed by memcmp
+//pixels are not copied, so the source images must live longer than the dict
+class TileDict
+{
+public:
+	struct Tile
+	{
+		const unsigned char *pixels;
+		//in bytes
+		int pitch;
+		int w, h;
+		uint64_t hash;
+	};
+
+	//thread safe, so tiles can be hashed in parallel before add
+	static uint64_t hashTile(const unsigned char *pixels, int pitch, int w, int h);
+
+	//return the index of the same tile if it's already in dict, otherwise add it
+	//tiles of different size never match
+	int add(const unsigned char *pixels, int pitch, int w, int h, uint64_t hash);
+
+	const Tile &operator[](int i) const
+	{
+		return tiles[i];
+	}
+	size_t size() const
+	{
+		return tiles.size();
+	}
+	void clear();
+
+private:
+	std::vector<Tile> tiles;
+	std::unordered_multimap<uint64_t, int> index;
+};